@@ -0,0 +1,541 @@
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <cstdlib>
+#include <filesystem>
+#include <latch>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "tiff_reader.h"
+#include "tiff_async.h"
+#include "tiff_pool.h"
+#include "tiff_batch.h"
+#include "tiff_display.h"
+#include "tiff_histogram.h"
+#include "tiff_tensor.h"
+#include "tiff_gen.h"
+
+// Every heap allocation of the process, so the pooled open can check that a
+// warm reader stays off the heap. Kept out of line so the compiler does not
+// pair malloc and free against the built-in new and delete.
+static std::atomic<uint64_t> heap_allocs{0};
+
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+
+struct bench_case
+{
+    tiff_gen::spec spec;
+    bool full_decode;  // skip frame decode on the very large cases
+    std::string path;
+};
+
+std::vector<bench_case> make_cases()
+{
+    using cs = tiff::colorspace_t;
+    std::vector<bench_case> cases;
+    auto add = [&](uint32_t w, uint32_t h, cs c, uint16_t bps, uint16_t spp, uint16_t extra, uint32_t rps, bool be, bool full) {
+        tiff_gen::spec s;
+        s.width = w;
+        s.height = h;
+        s.colorspace = c;
+        s.bit_per_sample = bps;
+        s.sample_per_pixel = spp;
+        s.extra_samples = extra;
+        s.rows_per_strip = rps;
+        s.big_endian = be;
+        cases.push_back({s, full, {}});
+    };
+
+    // sizes
+    add(64, 64, cs::MINISBLACK, 8, 1, 0, 16, false, true);
+    add(512, 512, cs::MINISBLACK, 8, 1, 0, 16, false, true);
+    add(1024, 1024, cs::MINISBLACK, 8, 1, 0, 16, false, true);
+    // bit depths
+    add(512, 512, cs::MINISBLACK, 1, 1, 0, 16, false, true);
+    add(512, 512, cs::MINISBLACK, 4, 1, 0, 16, false, true);
+    add(512, 512, cs::MINISBLACK, 16, 1, 0, 16, false, true);
+    // strip sizes
+    add(512, 512, cs::RGB, 8, 3, 0, 1, false, true);
+    add(512, 512, cs::RGB, 8, 3, 0, 64, false, true);
+    add(512, 512, cs::RGB, 8, 3, 0, 512, false, true);
+    add(256, 16384, cs::MINISBLACK, 8, 1, 0, 1, false, false);
+    // photometrics
+    add(512, 512, cs::MINISWHITE, 8, 1, 0, 16, false, true);
+    add(512, 512, cs::RGB, 8, 4, 1, 16, false, true);
+    add(512, 512, cs::RGB, 8, 4, 1, 16, false, true);
+    cases.back().spec.extra_sample_type = tiff::extra_data_t::ASSOCALPHA;
+    add(512, 512, cs::PALETTE, 8, 1, 0, 16, false, true);
+    add(512, 512, cs::YCBCR, 8, 3, 0, 16, false, true);
+    add(512, 512, cs::YCBCR, 8, 3, 0, 16, false, true);
+    cases.back().spec.ycbcr_sub_sampling[1] = 1;
+    add(512, 512, cs::SEPARATED, 8, 4, 0, 16, false, true);
+#ifdef TIFF_GEN_JPEG
+    add(512, 512, cs::YCBCR, 8, 3, 0, 16, false, true);
+    cases.back().spec.jpeg = true;
+    add(2048, 2048, cs::YCBCR, 8, 3, 0, 64, false, true);
+    cases.back().spec.jpeg = true;
+#endif
+    // endianness
+    add(512, 512, cs::RGB, 8, 3, 0, 16, true, true);
+    add(512, 512, cs::MINISBLACK, 16, 1, 0, 16, true, true);
+    add(256, 16384, cs::MINISBLACK, 8, 1, 0, 1, true, false);
+    // a long page stack, for opening with and without the sidecar index
+    add(64, 64, cs::MINISBLACK, 8, 1, 0, 1, false, false);
+    cases.back().spec.pages = 10000;
+    return cases;
+}
+
+void set_pixel_counters(benchmark::State& state, uint64_t pixels)
+{
+    state.SetItemsProcessed(state.iterations() * pixels);
+    state.SetBytesProcessed(state.iterations() * pixels * sizeof(tiff::color_t));
+}
+
+void bm_open(benchmark::State& state, const bench_case& c)
+{
+    for (auto _: state) {
+        auto r = tiff::reader::open(c.path);
+        if (!r.is_valid()) {
+            state.SkipWithError("open failed");
+            break;
+        }
+        benchmark::DoNotOptimize(r.get_page_count());
+    }
+    state.counters["strips"] = c.spec.strip_count();
+}
+
+// Reopens with a sidecar index that is already in place
+void bm_open_indexed(benchmark::State& state, const bench_case& c)
+{
+    tiff::reader::open_indexed(c.path);
+    for (auto _: state) {
+        auto r = tiff::reader::open_indexed(c.path);
+        if (!r.is_valid()) {
+            state.SkipWithError("open failed");
+            break;
+        }
+        benchmark::DoNotOptimize(r.get_page_count());
+    }
+    state.counters["pages"] = c.spec.pages;
+}
+
+void bm_open_metadata(benchmark::State& state, const bench_case& c)
+{
+    for (auto _: state) {
+        auto r = tiff::reader::open(c.path, tiff::open_mode_t::METADATA_ONLY);
+        if (!r.is_valid()) {
+            state.SkipWithError("open failed");
+            break;
+        }
+        benchmark::DoNotOptimize(r.get_page(0).width);
+    }
+    state.counters["strips"] = c.spec.strip_count();
+}
+
+// A warm reader reuses its arena, so a reset allocates the same handful of
+// blocks whatever the page count; more than that fails the case.
+void bm_open_pooled(benchmark::State& state, const bench_case& c)
+{
+    constexpr uint64_t max_warm_allocs = 4;
+    tiff::reader_pool pool(1);
+    // The first acquire opens the reader, the second grows its arena to fit
+    pool.acquire(c.path);
+    pool.acquire(c.path);
+    uint64_t allocs = 0;
+    for (auto _: state) {
+        const uint64_t before = heap_allocs.load(std::memory_order_relaxed);
+        auto r = pool.acquire(c.path);
+        allocs += heap_allocs.load(std::memory_order_relaxed) - before;
+        if (!r->is_valid()) {
+            state.SkipWithError("open failed");
+            break;
+        }
+        benchmark::DoNotOptimize(r->get_page_count());
+    }
+    const uint64_t per_open = state.iterations() ? allocs / state.iterations() : 0;
+    state.counters["allocs"] = per_open;
+    state.counters["pages"] = c.spec.pages;
+    if (per_open > max_warm_allocs) {
+        state.SkipWithError("warm reset allocates per page");
+    }
+}
+
+void bm_decode_pixel(benchmark::State& state, const bench_case& c)
+{
+    auto r = tiff::reader::open(c.path);
+    if (!r.is_valid()) {
+        state.SkipWithError("open failed");
+        return;
+    }
+    const tiff::page& p = r.get_page(0);
+    for (auto _: state) {
+        for (uint32_t y = 0; y < p.height; y++) {
+            for (uint32_t x = 0; x < p.width; x++) {
+                benchmark::DoNotOptimize(p.get_pixel(x, y));
+            }
+        }
+    }
+    set_pixel_counters(state, uint64_t(p.width) * p.height);
+}
+
+void bm_decode_rows(benchmark::State& state, const bench_case& c)
+{
+    auto r = tiff::reader::open(c.path);
+    if (!r.is_valid()) {
+        state.SkipWithError("open failed");
+        return;
+    }
+    const tiff::page& p = r.get_page(0);
+    std::vector<tiff::color_t> row(p.width);
+    for (auto _: state) {
+        for (uint32_t y = 0; y < p.height; y++) {
+            p.get_pixels(0, y, p.width, row.data());
+            benchmark::ClobberMemory();
+        }
+    }
+    set_pixel_counters(state, uint64_t(p.width) * p.height);
+}
+
+// The file fed through open_stream() and read top to bottom, as from a pipe
+void bm_stream_rows(benchmark::State& state, const bench_case& c)
+{
+    std::FILE* fp = std::fopen(c.path.c_str(), "rb");
+    if (!fp) {
+        state.SkipWithError("open failed");
+        return;
+    }
+    uint64_t pixels = 0;
+    for (auto _: state) {
+        std::rewind(fp);
+        auto r = tiff::reader::open_stream([fp](void* buf, size_t size) {
+            return std::fread(buf, 1, size, fp);
+        });
+        const tiff::page& p = r.get_page(0);
+        std::vector<tiff::color_t> row(p.width);
+        for (uint32_t y = 0; y < p.height; y++) {
+            p.get_pixels(0, y, p.width, row.data());
+            benchmark::ClobberMemory();
+        }
+        pixels = uint64_t(p.width) * p.height;
+    }
+    std::fclose(fp);
+    set_pixel_counters(state, pixels);
+}
+
+// Rows decoded with the alpha brought to a given representation
+void bm_alpha_rows(benchmark::State& state, const bench_case& c, tiff::alpha_output_t alpha)
+{
+    auto r = tiff::reader::open(c.path);
+    if (!r.is_valid()) {
+        state.SkipWithError("open failed");
+        return;
+    }
+    tiff::decode_options opt;
+    opt.alpha = alpha;
+    r.set_decode_options(opt);
+    const tiff::page& p = r.get_page(0);
+    std::vector<tiff::color_t> row(p.width);
+    for (auto _: state) {
+        for (uint32_t y = 0; y < p.height; y++) {
+            p.get_pixels(0, y, p.width, row.data());
+            benchmark::ClobberMemory();
+        }
+    }
+    set_pixel_counters(state, uint64_t(p.width) * p.height);
+}
+
+// Rows converted for a display as they are decoded
+template<tiff::display_format_t F>
+void bm_display_rows(benchmark::State& state, const bench_case& c)
+{
+    auto r = tiff::reader::open(c.path);
+    if (!r.is_valid()) {
+        state.SkipWithError("open failed");
+        return;
+    }
+    const tiff::page& p = r.get_page(0);
+    std::vector<tiff::display_pixel_t<F>> row(p.width);
+    for (auto _: state) {
+        for (uint32_t y = 0; y < p.height; y++) {
+            tiff::decode_display_line<F>(p, 0, y, p.width, row.data());
+            benchmark::ClobberMemory();
+        }
+    }
+    set_pixel_counters(state, uint64_t(p.width) * p.height);
+}
+
+// A centred window read as one rectangle against the same window fetched row by row.
+void bm_region(benchmark::State& state, const bench_case& c, bool rectangle)
+{
+    auto r = tiff::reader::open(c.path);
+    if (!r.is_valid()) {
+        state.SkipWithError("open failed");
+        return;
+    }
+    const tiff::page& p = r.get_page(0);
+    const uint32_t w = std::min<uint32_t>(128, p.width);
+    const uint32_t h = std::min<uint32_t>(128, p.height);
+    const uint32_t x = (p.width - w) / 2;
+    const uint32_t y = (p.height - h) / 2;
+    std::vector<tiff::color_t> out(size_t(w) * h);
+    for (auto _: state) {
+        if (rectangle) {
+            p.get_region(x, y, w, h, out.data());
+        } else {
+            for (uint32_t i = 0; i < h; i++) {
+                p.get_pixels(x, y + i, w, out.data() + size_t(i) * w);
+            }
+        }
+        benchmark::ClobberMemory();
+    }
+    set_pixel_counters(state, uint64_t(w) * h);
+}
+
+void bm_random_pixel(benchmark::State& state, const bench_case& c)
+{
+    auto r = tiff::reader::open(c.path);
+    if (!r.is_valid()) {
+        state.SkipWithError("open failed");
+        return;
+    }
+    const tiff::page& p = r.get_page(0);
+    constexpr size_t count = 4096;
+    std::mt19937 rng(42);
+    std::vector<std::pair<uint32_t, uint32_t>> coords(count);
+    for (auto& xy: coords) {
+        xy = {rng() % p.width, rng() % p.height};
+    }
+    for (auto _: state) {
+        for (auto& xy: coords) {
+            benchmark::DoNotOptimize(p.get_pixel(xy.first, xy.second));
+        }
+    }
+    set_pixel_counters(state, count);
+}
+
+// The whole page in one get_region call, with or without statistics
+void bm_page_region(benchmark::State& state, const bench_case& c, bool with_stats)
+{
+    auto r = tiff::reader::open(c.path);
+    if (!r.is_valid()) {
+        state.SkipWithError("open failed");
+        return;
+    }
+    const tiff::page& p = r.get_page(0);
+    std::vector<tiff::color_t> out(size_t(p.width) * p.height);
+    tiff::image_stats stats;
+    for (auto _: state) {
+        if (with_stats) {
+            stats = {};
+            p.get_region_stats(0, 0, p.width, p.height, out.data(), 0, stats);
+            benchmark::DoNotOptimize(stats.pixels);
+        } else {
+            p.get_region(0, 0, p.width, p.height, out.data());
+        }
+        benchmark::ClobberMemory();
+    }
+    set_pixel_counters(state, uint64_t(p.width) * p.height);
+}
+
+// Normalized planar float, at the page's size or fitted into 224x224
+void bm_tensor(benchmark::State& state, const bench_case& c, uint32_t size)
+{
+    auto r = tiff::reader::open(c.path);
+    if (!r.is_valid()) {
+        state.SkipWithError("open failed");
+        return;
+    }
+    const tiff::page& p = r.get_page(0);
+    tiff::tensor_options opt;
+    const float mean[] = {0.485f, 0.456f, 0.406f};
+    const float stddev[] = {0.229f, 0.224f, 0.225f};
+    opt.normalize(mean, stddev);
+    opt.width = size;
+    opt.height = size;
+    std::vector<uint8_t> out(tiff::tensor_bytes(p, opt));
+    for (auto _: state) {
+        tiff::decode_tensor(p, opt, out.data());
+        benchmark::ClobberMemory();
+    }
+    set_pixel_counters(state, uint64_t(p.width) * p.height);
+}
+
+// Every decodable case file through decode_batch at a given thread count
+void bm_batch(benchmark::State& state, const std::vector<std::string>& paths)
+{
+    tiff::batch_options opt;
+    opt.threads = state.range(0);
+    for (auto _: state) {
+        tiff::decode_batch(paths, [](tiff::batch_image& img) {
+            benchmark::DoNotOptimize(img.pixels.data());
+        }, opt);
+    }
+    uint64_t pixels = 0;
+    for (auto& path: paths) {
+        auto r = tiff::reader::open(path, tiff::open_mode_t::METADATA_ONLY);
+        pixels += uint64_t(r.get_page(0).width) * r.get_page(0).height;
+    }
+    set_pixel_counters(state, pixels);
+}
+
+// Fire-and-forget coroutine for the async benchmark
+struct detached_request
+{
+    struct promise_type
+    {
+        detached_request get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// One request of an image server: open, then decode in bands of 64 rows
+detached_request async_request(const std::string& path, tiff::async_context ctx, std::latch& done)
+{
+    auto r = co_await tiff::reader::open_async(path, ctx);
+    if (r->is_valid()) {
+        const tiff::page& p = r->get_page(0);
+        std::vector<tiff::color_t> band(size_t(p.width) * 64);
+        for (uint32_t y = 0; y < p.height; y += 64) {
+            co_await p.read_rows_async(y, 64, band.data(), ctx);
+            benchmark::DoNotOptimize(band.data());
+        }
+    }
+    done.count_down();
+}
+
+// Every decodable case file requested 16 times at once, all requests
+// suspended on a pool of state.range(0) threads
+void bm_async(benchmark::State& state, const std::vector<std::string>& paths)
+{
+    constexpr int repeats = 16;
+    tiff::thread_pool_executor pool(state.range(0));
+    for (auto _: state) {
+        std::latch done(paths.size() * repeats);
+        for (int i = 0; i < repeats; i++) {
+            for (auto& path: paths) {
+                async_request(path, pool, done);
+            }
+        }
+        done.wait();
+    }
+    uint64_t pixels = 0;
+    for (auto& path: paths) {
+        auto r = tiff::reader::open(path, tiff::open_mode_t::METADATA_ONLY);
+        pixels += uint64_t(r.get_page(0).width) * r.get_page(0).height * repeats;
+    }
+    set_pixel_counters(state, pixels);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path() / ("tiff_bench_" + std::to_string(::getpid()));
+    fs::create_directories(dir);
+
+    auto cases = make_cases();
+    for (size_t i = 0; i < cases.size(); i++) {
+        auto& c = cases[i];
+        c.path = (dir / ("case" + std::to_string(i) + ".tif")).string();
+        if (!tiff_gen::write(c.path, c.spec)) {
+            std::fprintf(stderr, "failed to write %s\n", c.path.c_str());
+            return 1;
+        }
+    }
+
+    const int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (auto& c: cases) {
+        const auto name = c.spec.name();
+        benchmark::RegisterBenchmark(("open/" + name).c_str(), bm_open, c);
+        benchmark::RegisterBenchmark(("open_metadata/" + name).c_str(), bm_open_metadata, c);
+        benchmark::RegisterBenchmark(("open_indexed/" + name).c_str(), bm_open_indexed, c);
+        benchmark::RegisterBenchmark(("open_pooled/" + name).c_str(), bm_open_pooled, c);
+        benchmark::RegisterBenchmark(("random_pixel/" + name).c_str(), bm_random_pixel, c);
+        benchmark::RegisterBenchmark(("region/" + name).c_str(), bm_region, c, true);
+        benchmark::RegisterBenchmark(("region_rows/" + name).c_str(), bm_region, c, false);
+        if (!c.full_decode) continue;
+        benchmark::RegisterBenchmark(("decode_pixel/" + name).c_str(), bm_decode_pixel, c)
+            ->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("decode_rows/" + name).c_str(), bm_decode_rows, c)
+            ->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("stream_rows/" + name).c_str(), bm_stream_rows, c)
+            ->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("page_region/" + name).c_str(), bm_page_region, c, false)
+            ->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("page_region_stats/" + name).c_str(), bm_page_region, c, true)
+            ->Unit(benchmark::kMillisecond);
+        if (c.spec.extra_samples) {
+            benchmark::RegisterBenchmark(("decode_rows_premultiplied/" + name).c_str(), bm_alpha_rows, c,
+                tiff::alpha_output_t::PREMULTIPLIED)->Unit(benchmark::kMillisecond);
+            benchmark::RegisterBenchmark(("decode_rows_straight/" + name).c_str(), bm_alpha_rows, c,
+                tiff::alpha_output_t::STRAIGHT)->Unit(benchmark::kMillisecond);
+        }
+        benchmark::RegisterBenchmark(("display_rgb565/" + name).c_str(),
+            bm_display_rows<tiff::display_format_t::RGB565>, c)->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("tensor/" + name).c_str(), bm_tensor, c, 0)
+            ->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("tensor_224/" + name).c_str(), bm_tensor, c, 224)
+            ->Unit(benchmark::kMillisecond);
+        // Each thread owns a reader, so this measures how well independent
+        // decodes scale.
+        benchmark::RegisterBenchmark(("throughput/" + name).c_str(), bm_decode_rows, c)
+            ->ThreadRange(1, max_threads)
+            ->UseRealTime()
+            ->Unit(benchmark::kMillisecond);
+    }
+
+    std::vector<std::string> batch_paths;
+    for (auto& c: cases) {
+        if (c.full_decode) batch_paths.push_back(c.path);
+    }
+    benchmark::RegisterBenchmark("batch", bm_batch, batch_paths)
+        ->RangeMultiplier(2)
+        ->Range(1, max_threads)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark("async", bm_async, batch_paths)
+        ->RangeMultiplier(2)
+        ->Range(1, max_threads)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    fs::remove_all(dir);
+    return 0;
+}
@@ -0,0 +1,413 @@
+#ifndef __TIFF_GEN_H
+#define __TIFF_GEN_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef TIFF_GEN_JPEG
+#include <jpeglib.h>
+#endif
+
+#include "tiff_reader.h"
+
+// Synthetic TIFF generator used by the benchmark suite.
+// It only produces what the reader understands: chunky (contig) IFDs with
+// strips laid out back to back, uncompressed or, when built with
+// TIFF_GEN_JPEG, JPEG-compressed with shared JPEGTables.
+namespace tiff_gen {
+
+struct spec
+{
+    uint32_t width = 256;
+    uint32_t height = 256;
+    uint16_t bit_per_sample = 8;
+    uint16_t sample_per_pixel = 1;
+    uint16_t extra_samples = 0;
+    tiff::extra_data_t extra_sample_type = tiff::extra_data_t::UNASSALPHA;
+    uint32_t rows_per_strip = 16;
+    tiff::colorspace_t colorspace = tiff::colorspace_t::MINISBLACK;
+    // Data unit size for YCbCr; rows_per_strip must be a multiple of [1].
+    uint16_t ycbcr_sub_sampling[2] = {2, 2};
+    // 8-bit gray, RGB or YCbCr only; YCbCr uses the subsampling above.
+    bool jpeg = false;
+    int jpeg_quality = 90;
+    bool big_endian = false;
+    // Identical IFDs chained one after another, all sharing the strips
+    uint32_t pages = 1;
+
+    bool is_ycbcr() const
+    {
+        return colorspace == tiff::colorspace_t::YCBCR;
+    }
+
+    std::string name() const
+    {
+        const char* cs = "gray";
+        switch (colorspace) {
+        case tiff::colorspace_t::MINISWHITE: cs = "white"; break;
+        case tiff::colorspace_t::RGB:
+            cs = !extra_samples ? "rgb" : extra_sample_type == tiff::extra_data_t::ASSOCALPHA ? "rgbpa" : "rgba";
+            break;
+        case tiff::colorspace_t::PALETTE:    cs = "pal"; break;
+        case tiff::colorspace_t::SEPARATED:  cs = extra_samples ? "cmyka" : "cmyk"; break;
+        case tiff::colorspace_t::YCBCR:      cs = "ycc"; break;
+        default: break;
+        }
+        char sub[16] = "";
+        if (is_ycbcr()) {
+            std::snprintf(sub, sizeof(sub), "_%ux%u", ycbcr_sub_sampling[0], ycbcr_sub_sampling[1]);
+        }
+        char stack[24] = "";
+        if (pages > 1) {
+            std::snprintf(stack, sizeof(stack), "/x%u", pages);
+        }
+        char buf[136];
+        std::snprintf(buf, sizeof(buf), "%ux%u%s/%s%u%s%s/rps%u/%s",
+                width, height, stack, cs, bit_per_sample, sub, jpeg ? "/jpeg" : "", rows_per_strip, big_endian ? "be" : "le");
+        return buf;
+    }
+
+    uint32_t strip_count() const
+    {
+        return (height + rows_per_strip - 1) / rows_per_strip;
+    }
+
+    // For YCbCr, a row of data units covering ycbcr_sub_sampling[1] lines
+    size_t row_bytes() const
+    {
+        if (is_ycbcr()) {
+            const size_t units = (width + ycbcr_sub_sampling[0] - 1) / ycbcr_sub_sampling[0];
+            return units * (ycbcr_sub_sampling[0] * ycbcr_sub_sampling[1] + 2);
+        }
+        return (static_cast<size_t>(width) * sample_per_pixel * bit_per_sample + 7) / 8;
+    }
+
+    size_t strip_bytes(uint32_t rows) const
+    {
+        if (is_ycbcr()) {
+            rows = (rows + ycbcr_sub_sampling[1] - 1) / ycbcr_sub_sampling[1];
+        }
+        return rows * row_bytes();
+    }
+};
+
+class builder
+{
+private:
+    const spec& s;
+    std::vector<uint8_t> out;
+
+    struct entry
+    {
+        uint16_t tag;
+        tiff::data_t type;
+        uint32_t count;
+        std::vector<uint8_t> data;
+    };
+    std::vector<entry> entries;
+
+    static size_t type_size(tiff::data_t t)
+    {
+        switch (t) {
+        case tiff::data_t::SHORT: return 2;
+        case tiff::data_t::LONG:  return 4;
+        default:                  return 1;
+        }
+    }
+
+    void put(std::vector<uint8_t>& v, size_t pos, uint64_t value, size_t size) const
+    {
+        for (size_t i = 0; i < size; i++) {
+            const size_t shift = s.big_endian ? (size - 1 - i) * 8 : i * 8;
+            v[pos + i] = static_cast<uint8_t>(value >> shift);
+        }
+    }
+
+    template<typename T>
+    void add(tiff::tag_t tag, tiff::data_t type, const std::vector<T>& values)
+    {
+        entry e{tiff::enum_base_cast(tag), type, static_cast<uint32_t>(values.size()), {}};
+        const size_t ts = type_size(type);
+        e.data.resize(values.size() * ts);
+        for (size_t i = 0; i < values.size(); i++) {
+            put(e.data, i * ts, values[i], ts);
+        }
+        entries.push_back(std::move(e));
+    }
+
+    void add_ascii(tiff::tag_t tag, const std::string& str)
+    {
+        entry e{tiff::enum_base_cast(tag), tiff::data_t::ASCII, static_cast<uint32_t>(str.size() + 1), {}};
+        e.data.assign(str.begin(), str.end());
+        e.data.push_back(0);
+        entries.push_back(std::move(e));
+    }
+
+    // Deterministic test pattern; every sample differs between neighbours.
+    uint32_t sample_value(uint32_t x, uint32_t y, uint16_t c) const
+    {
+        const uint32_t max = (s.bit_per_sample >= 32) ? 0xFFFFFFFFu : ((1u << s.bit_per_sample) - 1);
+        return ((x * 7 + y * 13 + c * 61) ^ (x >> 3)) & max;
+    }
+
+    // 8-bit data units: the luma of each covered pixel, then the chroma
+    // samples of the unit's top-left pixel.
+    std::vector<uint8_t> ycbcr_data() const
+    {
+        const uint32_t h = s.ycbcr_sub_sampling[0];
+        const uint32_t v = s.ycbcr_sub_sampling[1];
+        std::vector<uint8_t> px;
+        for (uint32_t top = 0; top < s.height; top += s.rows_per_strip) {
+            const uint32_t bottom = std::min(top + s.rows_per_strip, s.height);
+            for (uint32_t by = top; by < bottom; by += v) {
+                for (uint32_t bx = 0; bx < s.width; bx += h) {
+                    for (uint32_t j = 0; j < v; j++) {
+                        for (uint32_t i = 0; i < h; i++) {
+                            px.push_back(sample_value(bx + i, by + j, 0));
+                        }
+                    }
+                    px.push_back(sample_value(bx, by, 1));
+                    px.push_back(sample_value(bx, by, 2));
+                }
+            }
+        }
+        return px;
+    }
+
+    std::vector<uint8_t> pixel_data() const
+    {
+        if (s.is_ycbcr()) return ycbcr_data();
+        const size_t rb = s.row_bytes();
+        std::vector<uint8_t> px(rb * s.height, 0);
+        for (uint32_t y = 0; y < s.height; y++) {
+            uint8_t* row = px.data() + rb * y;
+            size_t bit = 0;
+            for (uint32_t x = 0; x < s.width; x++) {
+                for (uint16_t c = 0; c < s.sample_per_pixel; c++) {
+                    const uint32_t v = sample_value(x, y, c);
+                    if (s.bit_per_sample % 8 == 0) {
+                        const size_t bytes = s.bit_per_sample / 8;
+                        for (size_t i = 0; i < bytes; i++) {
+                            const size_t shift = s.big_endian ? (bytes - 1 - i) * 8 : i * 8;
+                            row[bit / 8 + i] = static_cast<uint8_t>(v >> shift);
+                        }
+                    } else {
+                        // Sub-byte samples are packed MSB first.
+                        for (uint16_t b = 0; b < s.bit_per_sample; b++) {
+                            const size_t pos = bit + b;
+                            if ((v >> (s.bit_per_sample - 1 - b)) & 1) {
+                                row[pos / 8] |= static_cast<uint8_t>(0x80 >> (pos % 8));
+                            }
+                        }
+                    }
+                    bit += s.bit_per_sample;
+                }
+            }
+        }
+        return px;
+    }
+
+    uint32_t strip_rows(uint32_t strip) const
+    {
+        return std::min(s.rows_per_strip, s.height - strip * s.rows_per_strip);
+    }
+
+#ifdef TIFF_GEN_JPEG
+    // Abbreviated streams: the tables go to the JPEGTables tag once and
+    // every strip is encoded without them.
+    std::vector<std::vector<uint8_t>> jpeg_strips(std::vector<uint8_t>& tables) const
+    {
+        jpeg_compress_struct c;
+        jpeg_error_mgr err;
+        c.err = jpeg_std_error(&err);
+        jpeg_create_compress(&c);
+        c.image_width = s.width;
+        c.image_height = s.rows_per_strip;
+        c.input_components = s.sample_per_pixel;
+        c.in_color_space = s.sample_per_pixel == 1 ? JCS_GRAYSCALE : JCS_RGB;
+        jpeg_set_defaults(&c);
+        jpeg_set_quality(&c, s.jpeg_quality, TRUE);
+        if (s.is_ycbcr()) {
+            c.comp_info[0].h_samp_factor = s.ycbcr_sub_sampling[0];
+            c.comp_info[0].v_samp_factor = s.ycbcr_sub_sampling[1];
+        } else if (s.sample_per_pixel == 3) {
+            jpeg_set_colorspace(&c, JCS_RGB);
+        }
+
+        unsigned char* mem = nullptr;
+        unsigned long size = 0;
+        jpeg_mem_dest(&c, &mem, &size);
+        jpeg_write_tables(&c);
+        tables.assign(mem, mem + size);
+        std::free(mem);
+
+        std::vector<std::vector<uint8_t>> strips(s.strip_count());
+        std::vector<uint8_t> row(static_cast<size_t>(s.width) * s.sample_per_pixel);
+        for (uint32_t i = 0; i < strips.size(); i++) {
+            mem = nullptr;
+            size = 0;
+            jpeg_mem_dest(&c, &mem, &size);
+            c.image_height = strip_rows(i);
+            jpeg_suppress_tables(&c, TRUE);
+            jpeg_start_compress(&c, FALSE);
+            for (uint32_t y = i * s.rows_per_strip; c.next_scanline < c.image_height; y++) {
+                for (uint32_t x = 0; x < s.width; x++) {
+                    for (uint16_t k = 0; k < s.sample_per_pixel; k++) {
+                        row[x * s.sample_per_pixel + k] = static_cast<uint8_t>(sample_value(x, y, k));
+                    }
+                }
+                JSAMPROW p = row.data();
+                jpeg_write_scanlines(&c, &p, 1);
+            }
+            jpeg_finish_compress(&c);
+            strips[i].assign(mem, mem + size);
+            std::free(mem);
+        }
+        jpeg_destroy_compress(&c);
+        return strips;
+    }
+#endif
+
+    std::vector<std::vector<uint8_t>> strip_data(std::vector<uint8_t>& tables) const
+    {
+#ifdef TIFF_GEN_JPEG
+        if (s.jpeg) return jpeg_strips(tables);
+#endif
+        tables.clear();
+        const auto px = pixel_data();
+        std::vector<std::vector<uint8_t>> strips(s.strip_count());
+        size_t pos = 0;
+        for (uint32_t i = 0; i < strips.size(); i++) {
+            const size_t n = s.strip_bytes(strip_rows(i));
+            strips[i].assign(px.begin() + pos, px.begin() + pos + n);
+            pos += n;
+        }
+        return strips;
+    }
+
+public:
+    builder(const spec& s) : s(s) {}
+
+    std::vector<uint8_t> build()
+    {
+        const uint32_t strips = s.strip_count();
+        std::vector<uint8_t> tables;
+        const auto data = strip_data(tables);
+        const bool jpeg = !tables.empty();
+
+        add<uint32_t>(tiff::tag_t::IMAGE_WIDTH, tiff::data_t::LONG, {s.width});
+        add<uint32_t>(tiff::tag_t::IMAGE_LENGTH, tiff::data_t::LONG, {s.height});
+        add<uint16_t>(tiff::tag_t::BITS_PER_SAMPLE, tiff::data_t::SHORT,
+                std::vector<uint16_t>(s.sample_per_pixel, s.bit_per_sample));
+        add<uint16_t>(tiff::tag_t::COMPRESSION, tiff::data_t::SHORT,
+                {tiff::enum_base_cast(jpeg ? tiff::compression_t::JPEG : tiff::compression_t::NONE)});
+        add<uint16_t>(tiff::tag_t::PHOTOMETRIC_INTERPRETATION, tiff::data_t::SHORT, {tiff::enum_base_cast(s.colorspace)});
+        add_ascii(tiff::tag_t::IMAGE_DESCRIPTION, "tiff_gen " + s.name());
+        add<uint32_t>(tiff::tag_t::STRIP_OFFSETS, tiff::data_t::LONG, std::vector<uint32_t>(strips, 0));
+        add<uint16_t>(tiff::tag_t::SAMPLES_PER_PIXEL, tiff::data_t::SHORT, {s.sample_per_pixel});
+        add<uint32_t>(tiff::tag_t::ROWS_PER_STRIP, tiff::data_t::LONG, {s.rows_per_strip});
+        std::vector<uint32_t> counts(strips);
+        for (uint32_t i = 0; i < strips; i++) {
+            counts[i] = static_cast<uint32_t>(data[i].size());
+        }
+        add<uint32_t>(tiff::tag_t::STRIP_BYTE_COUNTS, tiff::data_t::LONG, counts);
+        add<uint16_t>(tiff::tag_t::PLANAR_CONFIGURATION, tiff::data_t::SHORT, {tiff::enum_base_cast(tiff::planar_configuration_t::CONTIG)});
+        if (s.colorspace == tiff::colorspace_t::PALETTE) {
+            const size_t n = size_t(1) << s.bit_per_sample;
+            std::vector<uint16_t> map(3 * n);
+            for (size_t i = 0; i < n; i++) {
+                map[i] = static_cast<uint16_t>(i * 65535 / (n - 1));
+                map[n + i] = static_cast<uint16_t>(65535 - map[i]);
+                map[2 * n + i] = static_cast<uint16_t>((i * 4099) & 0xFFFF);
+            }
+            add<uint16_t>(tiff::tag_t::COLOR_MAP, tiff::data_t::SHORT, map);
+        }
+        if (s.is_ycbcr()) {
+            add<uint16_t>(tiff::tag_t::YCBCR_SUB_SAMPLING, tiff::data_t::SHORT,
+                    {s.ycbcr_sub_sampling[0], s.ycbcr_sub_sampling[1]});
+        }
+        if (jpeg) {
+            add<uint8_t>(tiff::tag_t::JPEG_TABLES, tiff::data_t::UNDEFINED, tables);
+        }
+        if (s.extra_samples) {
+            add<uint16_t>(tiff::tag_t::EXTRA_SAMPLES, tiff::data_t::SHORT,
+                    std::vector<uint16_t>(s.extra_samples, tiff::enum_base_cast(s.extra_sample_type)));
+        }
+        std::sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) { return a.tag < b.tag; });
+
+        // header, then per page its IFD and out-of-line values, then the
+        // strips, which every page shares
+        out.assign(8, 0);
+        out[0] = out[1] = s.big_endian ? 'M' : 'I';
+        put(out, 2, 42, 2);
+
+        std::vector<std::pair<size_t, bool>> strip_offsets;  // position, inline
+        size_t link_pos = 4;
+        for (uint32_t page = 0; page < std::max(s.pages, 1u); page++) {
+            const size_t ifd_pos = (out.size() + 1) & ~size_t(1);
+            const size_t ifd_size = 2 + entries.size() * 12 + 4;
+            size_t data_pos = ifd_pos + ifd_size;
+            out.resize(data_pos, 0);
+            put(out, link_pos, ifd_pos, 4);
+            put(out, ifd_pos, entries.size(), 2);
+
+            for (size_t i = 0; i < entries.size(); i++) {
+                auto& e = entries[i];
+                const size_t ep = ifd_pos + 2 + i * 12;
+                put(out, ep, e.tag, 2);
+                put(out, ep + 2, tiff::enum_base_cast(e.type), 2);
+                put(out, ep + 4, e.count, 4);
+                const bool is_offsets = e.tag == tiff::enum_base_cast(tiff::tag_t::STRIP_OFFSETS);
+                if (e.data.size() <= 4) {
+                    std::copy(e.data.begin(), e.data.end(), out.begin() + ep + 8);
+                    if (is_offsets) {
+                        strip_offsets.push_back({ep + 8, true});
+                    }
+                } else {
+                    data_pos = (data_pos + 1) & ~size_t(1); // word alignment
+                    out.resize(data_pos + e.data.size(), 0);
+                    put(out, ep + 8, data_pos, 4);
+                    std::copy(e.data.begin(), e.data.end(), out.begin() + data_pos);
+                    if (is_offsets) {
+                        strip_offsets.push_back({data_pos, false});
+                    }
+                    data_pos += e.data.size();
+                }
+            }
+            link_pos = ifd_pos + 2 + entries.size() * 12;
+            put(out, link_pos, 0, 4);
+        }
+
+        out.resize((out.size() + 1) & ~size_t(1), 0);
+        for (uint32_t i = 0; i < strips; i++) {
+            for (auto& so: strip_offsets) {
+                put(out, so.second ? so.first : so.first + i * 4, out.size(), 4);
+            }
+            out.insert(out.end(), data[i].begin(), data[i].end());
+        }
+        return out;
+    }
+};
+
+inline std::vector<uint8_t> build(const spec& s)
+{
+    return builder(s).build();
+}
+
+inline bool write(const std::string& path, const spec& s)
+{
+    const auto data = build(s);
+    FILE* fp = std::fopen(path.c_str(), "wb");
+    if (!fp) return false;
+    const bool ok = std::fwrite(data.data(), 1, data.size(), fp) == data.size();
+    std::fclose(fp);
+    return ok;
+}
+
+}
+
+#endif
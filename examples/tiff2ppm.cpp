@@ -1,44 +1,79 @@
 #include <bits/stdint-intn.h>
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <type_traits>
 #include <thread>
+#include <mutex>
 
 #include "tiff_reader.h"
+#include "tiff_batch.h"
 
-int main(int argc, char** argv)
+// Converts the TIFF arriving on stdin to a PPM on stdout. Rows go out as
+// their strips come in, so a pipe of any size converts in constant memory.
+static bool stream_to_ppm()
 {
-    std::vector<std::string> imgs;
-    for (int i = 1; i < argc; i++) {
-        imgs.emplace_back(argv[i]);
+    auto r = tiff::reader::open_stream([](void* buf, size_t size) {
+        return std::fread(buf, 1, size, stdin);
+    });
+    if (!r.is_valid()) {
+        std::cerr << "Failed to open stdin" << std::endl;
+        return false;
     }
 
-
-    for (auto& i: imgs) {
-        auto r = tiff::reader::open(i);
-        if (!r.is_valid()) {
-            std::cout << "Failed to open \"" << i << "\"" << std::endl;
-            continue;
+    const tiff::page& p = r.get_page(0);
+    std::cout << "P3" << '\n';
+    std::cout << p.width << " " << p.height << '\n';
+    std::cout << "255" << '\n';
+    std::vector<tiff::color_t> row(p.width);
+    for (uint32_t y = 0; y < p.height; y++) {
+        p.get_pixels(0, y, p.width, row.data());
+        for (auto& c: row) {
+            std::cout << +c.r << " " << +c.g << " " << +c.b << '\n';
         }
+    }
+    std::cout.flush();
+    return true;
+}
 
-        if (r.get_page_count() < 1) {
-            continue;
+int main(int argc, char** argv)
+{
+    std::vector<std::string> imgs(argv + 1, argv + argc);
+    // stdout carries the PPM, so nothing else may be printed there
+    if (std::find(imgs.begin(), imgs.end(), "-") != imgs.end()) {
+        if (imgs.size() != 1) {
+            std::cerr << "\"-\" cannot be combined with other files" << std::endl;
+            return 1;
         }
+        return stream_to_ppm() ? 0 : 1;
+    }
 
-        const tiff::page& p = r.get_page(0);
-        p.print_info();
+    // Files decode in parallel; the lock keeps each file's report together.
+    std::mutex out_mtx;
+    tiff::decode_batch(imgs, [&](tiff::batch_image& img) {
+        if (!img.p) {
+            std::lock_guard<std::mutex> lock(out_mtx);
+            std::cerr << "Failed to open \"" << img.path << "\"" << std::endl;
+            return;
+        }
 
-        std::ofstream of(i + ".ppm");
+        std::ofstream of(img.path + ".ppm");
         of << "P3" << std::endl;
-        of << p.width << " " << p.height << std::endl;
+        of << img.width << " " << img.height << std::endl;
         of << "255" << std::endl;
-        for (size_t h = 0; h < p.height; h++) {
-            for (size_t w = 0; w < p.width; w++) {
-                auto c = p.get_pixel(w, h);
-                of << +c.r << " " << +c.g << " " << +c.b << std::endl;
-            }
+        for (auto& c: img.pixels) {
+            of << +c.r << " " << +c.g << " " << +c.b << '\n';
         }
-    }
+
+        std::lock_guard<std::mutex> lock(out_mtx);
+        img.p->print_info();
+        if (tiff::stats_enabled) {
+            img.p->print_stats();
+            img.r->print_stats();
+        }
+    });
+    return 0;
 }
 
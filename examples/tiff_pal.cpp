@@ -1,16 +1,11 @@
-#include "tiff_pal.h"
+// off_t must be 64 bits for fseeko/ftello on 32-bit POSIX
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
 
-constexpr const uint32_t tiff_pal::INFO_BUF_SIZE;
-constexpr const uint32_t tiff_pal::PIX_BUF_SIZE;
-constexpr const uint32_t tiff_pal::PIX_BUF_COUNT;
-uint8_t tiff_pal::info_buffer[tiff_pal::INFO_BUF_SIZE];
-uint8_t tiff_pal::pix_buffer[PIX_BUF_COUNT][PIX_BUF_SIZE];
-tiff_pal::stat tiff_pal::pix_buffer_statics[tiff_pal::PIX_BUF_COUNT];
+#include "tiff_pal.h"
 
-namespace pal_mtx {
-    std::mutex info_buf_mtx;
-    std::mutex pix_buf_mtx;
-}
+#include <cstdio>
 
 bool tiff_pal::init() { return true; }
 bool tiff_pal::deinit() { return true; }
@@ -19,8 +14,20 @@ intptr_t tiff_pal::fopen(const char* path, const char* mode) {
     return reinterpret_cast<intptr_t>(::fopen(path, mode));
 }
 
-int tiff_pal::fseek(intptr_t fp, long offset, int origin) {
-    return ::fseek(reinterpret_cast<FILE*>(fp), offset, origin);
+int tiff_pal::fseek(intptr_t fp, int64_t offset, int origin) {
+#ifdef _WIN32
+    return ::_fseeki64(reinterpret_cast<FILE*>(fp), offset, origin);
+#else
+    return ::fseeko(reinterpret_cast<FILE*>(fp), static_cast<off_t>(offset), origin);
+#endif
+}
+
+int64_t tiff_pal::ftell(intptr_t fp) {
+#ifdef _WIN32
+    return ::_ftelli64(reinterpret_cast<FILE*>(fp));
+#else
+    return ::ftello(reinterpret_cast<FILE*>(fp));
+#endif
 }
 
 int tiff_pal::fclose(intptr_t file) {
@@ -31,19 +38,3 @@ int tiff_pal::fclose(intptr_t file) {
 size_t tiff_pal::fread(void* buf, size_t size, size_t n, intptr_t fp) {
     return ::fread(buf, size, n, reinterpret_cast<FILE*>(fp));
 }
-
-void tiff_pal::info_buffer_lock() {
-    pal_mtx::info_buf_mtx.lock();
-}
-
-void tiff_pal::info_buffer_unlock() {
-    pal_mtx::info_buf_mtx.unlock();
-}
-
-void tiff_pal::pix_buffer_lock() {
-    pal_mtx::pix_buf_mtx.lock();
-}
-
-void tiff_pal::pix_buffer_unlock() {
-    pal_mtx::pix_buf_mtx.unlock();
-}
@@ -0,0 +1,178 @@
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tiff_gen.h"
+
+// Stand-in for the libFuzzer driver on compilers without it. It replays the
+// given files (or built-in seeds when there are none) and then feeds them
+// through random mutations; it has no coverage feedback, so it is meant for
+// sanitizer smoke runs and for reproducing crashes, not for long campaigns.
+//
+//   tiff_fuzz [-runs=N] [-seed=S] [FILE|DIR ...]
+//
+// An input that kills the process is written to crash-input.tif first.
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+namespace {
+
+using input_t = std::vector<uint8_t>;
+
+const input_t* current = nullptr;
+
+void dump_current(int sig)
+{
+    if (current) {
+        const int fd = ::open("crash-input.tif", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            if (::write(fd, current->data(), current->size()) < 0) {}
+            ::close(fd);
+        }
+    }
+    std::signal(sig, SIG_DFL);
+    std::raise(sig);
+}
+
+void run(const input_t& in)
+{
+    current = &in;
+    LLVMFuzzerTestOneInput(in.data(), in.size());
+    current = nullptr;
+}
+
+std::vector<input_t> builtin_seeds()
+{
+    using cs = tiff::colorspace_t;
+    struct seed { uint16_t bps, spp, extra; cs c; bool be; bool jpeg = false; };
+    const seed seeds[] = {
+        {1, 1, 0, cs::MINISWHITE, false},
+        {4, 1, 0, cs::PALETTE, true},
+        {8, 1, 0, cs::MINISBLACK, false},
+        {8, 2, 0, cs::MINISBLACK, true},
+        {8, 3, 0, cs::RGB, true},
+        {8, 4, 1, cs::RGB, false},
+        {16, 1, 0, cs::MINISBLACK, true},
+        {16, 3, 0, cs::RGB, false},
+        {8, 3, 0, cs::YCBCR, true},
+        {16, 5, 1, cs::SEPARATED, false},
+        {8, 3, 0, cs::YCBCR, false, true},
+        {8, 1, 0, cs::MINISBLACK, true, true},
+    };
+    std::vector<input_t> out;
+    for (auto& s: seeds) {
+        tiff_gen::spec g;
+        g.width = 13;
+        g.height = 7;
+        g.rows_per_strip = s.jpeg ? 4 : 3;
+        g.bit_per_sample = s.bps;
+        g.sample_per_pixel = s.spp;
+        g.extra_samples = s.extra;
+        g.colorspace = s.c;
+        g.big_endian = s.be;
+        g.jpeg = s.jpeg;
+        out.push_back(tiff_gen::build(g));
+    }
+    return out;
+}
+
+void mutate(input_t& in, std::mt19937& rng)
+{
+    const int count = 1 + rng() % 8;
+    for (int i = 0; i < count && !in.empty(); i++) {
+        const size_t pos = rng() % in.size();
+        switch (rng() % 5) {
+        case 0:
+            in[pos] ^= 1u << (rng() % 8);
+            break;
+        case 1: {
+            static const uint8_t interesting[] = {0x00, 0x01, 0x7F, 0x80, 0xFF};
+            in[pos] = interesting[rng() % sizeof(interesting)];
+            break;
+        }
+        case 2: {
+            const uint32_t v = rng();
+            std::memcpy(in.data() + pos, &v, std::min<size_t>(sizeof(v), in.size() - pos));
+            break;
+        }
+        case 3:
+            in.resize(pos);
+            break;
+        default:
+            in.insert(in.begin() + pos, rng() % 16, static_cast<uint8_t>(rng()));
+            break;
+        }
+    }
+}
+
+bool read_file(const std::filesystem::path& path, input_t& out)
+{
+    std::ifstream f(path, std::ios::binary);
+    if (!f) return false;
+    out.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    return true;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    namespace fs = std::filesystem;
+    unsigned long runs = 0;
+    unsigned long seed = 1;
+    std::vector<input_t> inputs;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg.rfind("-runs=", 0) == 0) {
+            runs = std::strtoul(arg.c_str() + 6, nullptr, 10);
+        } else if (arg.rfind("-seed=", 0) == 0) {
+            seed = std::strtoul(arg.c_str() + 6, nullptr, 10);
+        } else if (fs::is_directory(arg)) {
+            for (auto& e: fs::directory_iterator(arg)) {
+                input_t in;
+                if (e.is_regular_file() && read_file(e.path(), in)) inputs.push_back(std::move(in));
+            }
+        } else {
+            input_t in;
+            if (!read_file(arg, in)) {
+                std::fprintf(stderr, "cannot read %s\n", arg.c_str());
+                return 1;
+            }
+            inputs.push_back(std::move(in));
+        }
+    }
+    if (inputs.empty()) {
+        inputs = builtin_seeds();
+    }
+
+    std::signal(SIGSEGV, dump_current);
+    std::signal(SIGABRT, dump_current);
+    std::signal(SIGFPE, dump_current);
+    std::signal(SIGBUS, dump_current);
+
+    for (auto& in: inputs) {
+        run(in);
+    }
+
+    std::mt19937 rng(seed);
+    for (unsigned long i = 0; i < runs; i++) {
+        input_t in = inputs[rng() % inputs.size()];
+        mutate(in, rng);
+        run(in);
+    }
+
+    std::fprintf(stderr, "Done: %zu inputs, %lu mutations\n", inputs.size(), runs);
+    return 0;
+}
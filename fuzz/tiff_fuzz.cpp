@@ -0,0 +1,70 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "tiff_histogram.h"
+#include "tiff_reader.h"
+
+// Fuzz target for the parser and the pixel accessors. Every input is opened
+// from memory in both open modes and each page is decoded through all the
+// accessors on a bounded window, so one input stays cheap.
+// The reader and libjpeg report rejected files on stderr; run libFuzzer
+// with -close_fd_mask=2 to keep the log quiet.
+namespace {
+
+void exercise(const tiff::page& p)
+{
+    const uint32_t w = std::min<uint32_t>(p.width, 256);
+    const uint32_t h = std::min<uint32_t>(p.height, 64);
+    if (w == 0 || h == 0) return;
+
+    std::vector<tiff::color_t> buf(size_t(w) * h);
+    for (uint32_t y = 0; y < h; y++) {
+        p.get_pixels(0, y, w, buf.data() + size_t(y) * w);
+    }
+    p.get_region(p.width / 3, p.height / 3, w, h, buf.data());
+    tiff::image_stats stats;
+    p.get_region_stats(0, 0, w, h, buf.data(), 0, stats);
+
+    const uint32_t xs[] = {0, p.width / 2, p.width - 1, p.width};
+    const uint32_t ys[] = {0, p.height / 2, p.height - 1, p.height};
+    for (auto y: ys) {
+        for (auto x: xs) {
+            p.get_pixel(x, y);
+            p.get_pixel_without_buffering(x, y);
+        }
+    }
+}
+
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    for (auto mode: {tiff::open_mode_t::FULL, tiff::open_mode_t::METADATA_ONLY}) {
+        auto r = tiff::reader::open_memory(data, size, mode);
+        if (!r.is_valid()) continue;
+        // Each mode also runs one of the alpha conversions
+        tiff::decode_options opt;
+        opt.alpha = mode == tiff::open_mode_t::FULL ? tiff::alpha_output_t::PREMULTIPLIED : tiff::alpha_output_t::STRAIGHT;
+        r.set_decode_options(opt);
+        for (uint32_t i = 0; i < r.get_page_count(); i++) {
+            exercise(r.get_page(i));
+        }
+    }
+
+    // The same bytes as a pipe, handed over in small pieces with a spool
+    // limit the larger inputs exceed
+    size_t pos = 0;
+    auto r = tiff::reader::open_stream([&](void* buf, size_t n) {
+        n = std::min<size_t>({n, size - pos, 1000});
+        std::memcpy(buf, data + pos, n);
+        pos += n;
+        return n;
+    }, 4096);
+    if (r.is_valid()) {
+        exercise(r.get_page(0));
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __TIFF_ARENA_H
+#define __TIFF_ARENA_H
+
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+namespace tiff {
+
+// Bump allocator behind the metadata of a reader. Like
+// std::pmr::monotonic_buffer_resource, deallocation is a no-op and memory is
+// returned when the arena is destroyed, but rewind() keeps the blocks so a
+// reused reader allocates nothing once it has seen a file of similar size.
+class arena_resource final : public std::pmr::memory_resource
+{
+private:
+    struct block
+    {
+        std::byte* data;
+        size_t size;
+    };
+
+    std::pmr::memory_resource* upstream;
+    std::vector<block> blocks;
+    size_t current = 0;
+    size_t used = 0;
+    size_t next_size;
+
+public:
+    arena_resource(const size_t initial_size, std::pmr::memory_resource* upstream);
+    arena_resource(const arena_resource&) = delete;
+    arena_resource& operator=(const arena_resource&) = delete;
+    ~arena_resource();
+
+    // Everything allocated before is invalidated.
+    void rewind();
+    size_t capacity() const;
+    std::pmr::memory_resource* upstream_resource() const
+    {
+        return upstream;
+    }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void*, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource& o) const noexcept override
+    {
+        return this == &o;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef __TIFF_ASYNC_H
+#define __TIFF_ASYNC_H
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "tiff_reader.h"
+
+namespace tiff {
+
+// Runs the blocking half of the *_async calls. File reads go through
+// tiff_pal and block, so awaiting frees the awaiting thread only when
+// post() hands the work to another one. post() may run fn on any thread,
+// now or later, but must run it exactly once.
+class executor
+{
+public:
+    virtual ~executor() = default;
+    virtual void post(std::function<void()> fn) = 0;
+};
+
+// A fixed set of threads taking posted work in order. Work still queued
+// when it is destroyed runs before the threads exit.
+class thread_pool_executor : public executor
+{
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> queue;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+
+    void work();
+
+public:
+    // 0 uses all hardware threads
+    explicit thread_pool_executor(const unsigned threads = 0);
+    ~thread_pool_executor() override;
+    thread_pool_executor(const thread_pool_executor&) = delete;
+    thread_pool_executor& operator=(const thread_pool_executor&) = delete;
+
+    void post(std::function<void()> fn) override;
+    unsigned size() const
+    {
+        return threads.size();
+    }
+};
+
+// Runs posted work right away on the posting thread, so async calls
+// complete without suspending
+class inline_executor : public executor
+{
+public:
+    void post(std::function<void()> fn) override
+    {
+        fn();
+    }
+};
+
+// Where an async call does its work (io) and where the awaiting coroutine
+// continues afterwards: on resume when given, as an event loop would
+// want, otherwise on the thread that finished the work.
+struct async_context
+{
+    executor& io;
+    executor* resume = nullptr;
+
+    async_context(executor& io, executor* resume = nullptr) : io(io), resume(resume) {}
+};
+
+// Awaitable result of an async call. The work is posted when the op is
+// awaited, not when it is created; await each op once. Work that finishes
+// before post() returns continues the coroutine without suspending it.
+template<typename T>
+class async_op
+{
+private:
+    std::function<T()> work;
+    async_context ctx;
+    T result{};
+    // Set by whichever of the work and await_suspend gets there first; the
+    // second one resumes the coroutine.
+    std::atomic<bool> done{false};
+
+public:
+    async_op(std::function<T()> work, const async_context& ctx) : work(std::move(work)), ctx(ctx) {}
+    async_op(const async_op&) = delete;
+    async_op& operator=(const async_op&) = delete;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        ctx.io.post([this, h]() {
+            result = work();
+            if (!done.exchange(true, std::memory_order_acq_rel)) return;
+            // The coroutine is suspended and this op stays alive until it is resumed
+            if (ctx.resume) {
+                ctx.resume->post([h]() { h.resume(); });
+            } else {
+                h.resume();
+            }
+        });
+        return !done.exchange(true, std::memory_order_acq_rel);
+    }
+
+    T await_resume()
+    {
+        return std::move(result);
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef __TIFF_BATCH_H
+#define __TIFF_BATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "tiff_histogram.h"
+#include "tiff_reader.h"
+
+namespace tiff {
+
+struct batch_options
+{
+    unsigned threads = 0;               // 0 uses all hardware threads
+    // Rows decoded per task. 0 sizes tasks to about 256 KiB of output,
+    // rounded to whole strips.
+    uint32_t rows_per_task = 0;
+    open_mode_t mode = open_mode_t::FULL;
+    decode_options decode;
+    // Fills batch_image::stats during decode
+    bool stats = false;
+};
+
+// First page of one source, decoded to row-major RGBA.
+struct batch_image
+{
+    size_t index;                       // position in the source list
+    const std::string& path;
+    const reader* r;                    // nullptr when the file failed to open
+    const page* p;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<color_t> pixels;
+    image_stats stats;                  // empty unless batch_options::stats
+};
+
+// Decodes many files on a work-stealing pool. Each file is opened by one
+// task, which splits its rows into decode tasks on the opening thread's
+// queue. Idle threads steal them, so one large image spreads over all
+// cores while many small ones keep every core busy.
+// The callback runs on the worker that finishes an image, once per source,
+// in no particular order; it must be thread safe. The reader and page stay
+// valid for the duration of the call. Returns the number of images decoded.
+size_t decode_batch(const std::vector<std::string>& paths,
+        const std::function<void(batch_image&)>& callback, const batch_options& opt = {});
+
+}
+
+#endif
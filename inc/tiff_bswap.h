@@ -0,0 +1,31 @@
+#ifndef __TIFF_BSWAP_H
+#define __TIFF_BSWAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace tiff {
+
+// In-place byte swap of `count` elements. Picks an SSSE3 or AVX2 shuffle
+// kernel at runtime when the CPU has one, otherwise swaps one element at a time.
+void bswap16_array(void* data, const size_t count);
+void bswap32_array(void* data, const size_t count);
+void bswap64_array(void* data, const size_t count);
+
+template<typename T>
+void bswap_array(T* data, const size_t count)
+{
+    static_assert(std::is_scalar<T>::value && !std::is_pointer<T>::value, "bswap_array needs a scalar type.");
+    if constexpr (sizeof(T) == 2) {
+        bswap16_array(data, count);
+    } else if constexpr (sizeof(T) == 4) {
+        bswap32_array(data, count);
+    } else if constexpr (sizeof(T) == 8) {
+        bswap64_array(data, count);
+    }
+}
+
+}
+
+#endif
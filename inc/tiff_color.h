@@ -0,0 +1,61 @@
+#ifndef __TIFF_COLOR_H
+#define __TIFF_COLOR_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace tiff {
+
+struct color_t;
+
+// YCbCr to RGB factors in Q13 fixed point, derived from the luma
+// coefficients of the YCbCrCoefficients tag:
+//   R = Y + cr_r * Cr'
+//   G = Y + cb_g * Cb' + cr_g * Cr'
+//   B = Y + cb_b * Cb'
+// where Cb' and Cr' are centred on 128.
+struct ycbcr_factors
+{
+    static constexpr int shift = 13;
+    int16_t cr_r;
+    int16_t cb_g;
+    int16_t cr_g;
+    int16_t cb_b;
+};
+
+ycbcr_factors make_ycbcr_factors(const double luma_red, const double luma_green, const double luma_blue);
+
+// Converts n pixels given as separate Y, Cb and Cr rows of 8-bit samples.
+// Alpha is left at 0. Uses SSE2 eight pixels at a time where available;
+// the scalar tail computes the same rounding, so results do not depend on
+// the path taken.
+void ycbcr_to_rgba(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, const size_t n,
+        const ycbcr_factors& f, color_t* dst);
+
+// Splits n_units YCbCr data units that are two pixels wide into Y, Cb and
+// Cr rows of 2 * n_units samples each. The luma pair is taken at y_offset
+// in every unit and the chroma pair at c_offset; each chroma sample is
+// replicated over both pixels of its unit. Uses SSE2 eight units at a time
+// where available; the gather itself is vectorized for the 2x1 layout.
+void ycbcr_unpack_2x(const uint8_t* units, const size_t unit_bytes, const size_t y_offset,
+        const size_t c_offset, const size_t n_units, uint8_t* y, uint8_t* cb, uint8_t* cr);
+
+// Converts n packed 8-bit CMYK pixels with the naive ink model
+// R = (255 - C) * (255 - K) / 255, rounded. Alpha is left at 0. Uses SSE2
+// four pixels at a time where available, with the same rounding as the
+// scalar tail.
+void cmyk_to_rgba(const uint8_t* cmyk, const size_t n, color_t* dst);
+
+// Multiplies the colors of n pixels by their alpha, c * a / 255 rounded.
+// Alpha is kept. Uses SSE2 four pixels at a time where available.
+void premultiply_alpha(color_t* pixs, const size_t n);
+
+// Divides the colors of n premultiplied pixels by their alpha, as
+// c * (255.0f / a) rounded to nearest even and clamped to 255; pixels with
+// alpha 0 come out black. Alpha is kept. The SSE2 path does the same
+// single-precision steps as the scalar tail, so both round alike.
+void unpremultiply_alpha(color_t* pixs, const size_t n);
+
+}
+
+#endif
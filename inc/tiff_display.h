@@ -0,0 +1,83 @@
+#ifndef __TIFF_DISPLAY_H
+#define __TIFF_DISPLAY_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "tiff_reader.h"
+
+// Pixel format of decode_display_line() without an explicit one; the build
+// sets it from TIFF_READER_DISPLAY_FORMAT.
+#ifndef TIFF_DISPLAY_FORMAT
+#define TIFF_DISPLAY_FORMAT RGB565
+#endif
+
+namespace tiff {
+
+enum class display_format_t : uint8_t
+{
+    RGB565,         // 5-6-5 bits in a native-endian uint16_t, red on top
+    BGRA8888,       // bytes b, g, r, a; a is 255 unless the page delivers alpha
+    GRAY8,          // BT.601 luma
+};
+
+struct bgra_t
+{
+    uint8_t b;
+    uint8_t g;
+    uint8_t r;
+    uint8_t a;
+};
+
+template<display_format_t F> struct display_pixel;
+template<> struct display_pixel<display_format_t::RGB565> { using type = uint16_t; };
+template<> struct display_pixel<display_format_t::BGRA8888> { using type = bgra_t; };
+template<> struct display_pixel<display_format_t::GRAY8> { using type = uint8_t; };
+
+template<display_format_t F>
+using display_pixel_t = typename display_pixel<F>::type;
+
+constexpr display_format_t display_format = display_format_t::TIFF_DISPLAY_FORMAT;
+
+namespace detail {
+
+template<display_format_t F>
+struct display_line
+{
+    display_pixel_t<F>* dst;
+    bool opaque;
+
+    static void convert(const color_t* src, const size_t offset, const size_t n, void* ctx)
+    {
+        const auto& line = *static_cast<const display_line*>(ctx);
+        display_pixel_t<F>* dst = line.dst + offset;
+        for (size_t i = 0; i < n; i++) {
+            const color_t c = src[i];
+            if constexpr (F == display_format_t::RGB565) {
+                dst[i] = static_cast<uint16_t>((c.r >> 3) << 11 | (c.g >> 2) << 5 | c.b >> 3);
+            } else if constexpr (F == display_format_t::BGRA8888) {
+                dst[i] = {c.b, c.g, c.r, line.opaque ? uint8_t(255) : c.a};
+            } else {
+                // The weights sum to 256, so gray input comes back unchanged
+                dst[i] = static_cast<uint8_t>((77 * c.r + 150 * c.g + 29 * c.b + 128) >> 8);
+            }
+        }
+    }
+};
+
+}
+
+// Decodes up to n pixels of row y from x straight into dst in format F,
+// stopping at the row end. Conversion happens chunk by chunk on the stack
+// (see page::get_line_chunked), so only the caller's line buffer is
+// written and nothing is allocated. Returns the pixels written.
+template<display_format_t F = display_format>
+int decode_display_line(const page& p, const uint32_t x, const uint32_t y, const size_t n, display_pixel_t<F>* dst)
+{
+    detail::display_line<F> line{dst, !p.has_alpha()};
+    return p.get_line_chunked(x, y, n, detail::display_line<F>::convert, &line);
+}
+
+}
+
+#endif
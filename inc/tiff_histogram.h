@@ -0,0 +1,64 @@
+#ifndef __TIFF_HISTOGRAM_H
+#define __TIFF_HISTOGRAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tiff {
+
+struct color_t;
+enum class alpha_output_t : uint8_t;
+
+// Histogram of one channel; min, max and mean are read off the bins.
+struct channel_stats
+{
+    std::vector<uint64_t> histogram;    // one bin per sample value
+
+    uint64_t count() const;
+    // Smallest and largest value present, 0 when empty
+    uint32_t min() const;
+    uint32_t max() const;
+    double mean() const;
+};
+
+// Per-channel statistics of decoded pixels, filled by page::get_region_stats()
+// or the stats option of decode_batch(). 8-bit data counts the decoded
+// color_t samples; 16-bit data counts the samples of the file at full
+// precision, with the alpha conversion of decode_options::alpha applied.
+// Either way pages without alpha count it as 0, as it is delivered. Gray
+// images count one channel, which channel() returns for r, g and b alike.
+struct image_stats
+{
+    uint8_t bits = 0;                   // 8 or 16, 0 until first used
+    bool gray = false;
+    uint64_t pixels = 0;
+    channel_stats channels[4];          // r, g, b, a; only r for gray
+
+    bool empty() const
+    {
+        return bits == 0;
+    }
+
+    const channel_stats& channel(const unsigned c) const
+    {
+        return channels[gray && c < 3 ? 0 : c];
+    }
+
+    // Clears the counts and sizes the bins for bits-deep samples
+    void reset(const uint8_t bits, const bool gray);
+    // Adds the counts of o, which must have the same depth and channels
+    bool merge(const image_stats& o);
+};
+
+// Counts n decoded pixels into 8-bit stats
+void accumulate_stats(image_stats& s, const color_t* pixs, const size_t n);
+// Counts n pixels of spp 16-bit samples into 16-bit stats; the samples are
+// swapped from file order when swap is set, inverted for MinIsWhite, then
+// given the alpha conversion the decoder applies (AS_STORED for none).
+void accumulate_stats16(image_stats& s, const uint8_t* samples, const size_t n, const uint16_t spp,
+        const bool swap, const bool invert, const alpha_output_t alpha);
+
+}
+
+#endif
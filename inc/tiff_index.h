@@ -0,0 +1,45 @@
+#ifndef __TIFF_INDEX_H
+#define __TIFF_INDEX_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "tiff_reader.h"
+
+namespace tiff {
+
+struct page_summary
+{
+    uint32_t index;
+    uint32_t width;
+    uint32_t height;
+    uint16_t sample_per_pixel;
+    std::vector<uint16_t> bit_per_samples;
+    compression_t compression;
+    colorspace_t colorspace;
+    std::string description;
+};
+
+struct file_summary
+{
+    std::string path;
+    bool valid = false;
+    std::vector<page_summary> pages;
+};
+
+// Bulk metadata scan. Every file is opened with open_mode_t::METADATA_ONLY,
+// so no strip table or color map is read. The callback runs on the worker
+// threads and must be thread safe. threads == 0 uses all hardware threads.
+void index_files(const std::vector<std::string>& paths, unsigned threads,
+        const std::function<void(const file_summary&)>& callback);
+std::vector<file_summary> index_files(const std::vector<std::string>& paths, unsigned threads = 0);
+
+// Scans the *.tif/*.tiff files of a directory.
+std::vector<std::string> list_tiff_files(const std::string& dir, const bool recursive = false);
+std::vector<file_summary> index_directory(const std::string& dir, unsigned threads = 0, const bool recursive = false);
+
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __TIFF_JPEG_H
+#define __TIFF_JPEG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace tiff {
+
+struct color_t;
+enum class colorspace_t : uint16_t;
+
+// Whether the library was built with a JPEG decoder (TIFF_READER_JPEG).
+bool jpeg_supported();
+
+// Decodes the JPEG stream of one strip row by row into color_t, straight
+// into the caller's rows when libjpeg-turbo's RGBA output is available.
+// A decoder is meant to be reused for many strips, but it is not thread
+// safe; each thread keeps its own.
+class jpeg_decoder
+{
+public:
+    jpeg_decoder();
+    ~jpeg_decoder();
+    jpeg_decoder(const jpeg_decoder&) = delete;
+    jpeg_decoder& operator=(const jpeg_decoder&) = delete;
+
+    // Reads the headers of a strip, after the tables of a JPEGTables tag
+    // when there are any (strips are then abbreviated streams). Fails
+    // unless the image is `width` pixels wide and has the component count
+    // of cs: 1 for BlackIsZero, 3 for RGB or YCbCr.
+    bool start(const uint8_t* tables, const size_t tables_size, const uint8_t* data, const size_t size,
+            const colorspace_t cs, const uint32_t width);
+    bool skip_rows(const uint32_t n);
+    // Decodes the next row of width pixels into row; alpha is 0.
+    bool read_row(color_t* row);
+    // Drops the rest of the strip.
+    void finish();
+
+private:
+    struct impl;
+    std::unique_ptr<impl> d;
+};
+
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef __TIFF_POOL_H
+#define __TIFF_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tiff_reader.h"
+
+namespace tiff {
+
+// Keeps closed readers around and reopens them with reader::reset(), so
+// their arenas are reused instead of being rebuilt for every file.
+// Handles return their reader to the pool and must not outlive it.
+class reader_pool
+{
+private:
+    struct returner
+    {
+        reader_pool* pool;
+        void operator()(reader* r) const;
+    };
+
+    std::mutex mtx;
+    std::vector<std::unique_ptr<reader>> idle;
+    const size_t max_idle;
+    std::pmr::memory_resource* const upstream;
+
+    void release(reader* r);
+
+public:
+    using handle = std::unique_ptr<reader, returner>;
+
+    explicit reader_pool(const size_t max_idle = 8, std::pmr::memory_resource* upstream = nullptr);
+    reader_pool(const reader_pool&) = delete;
+    reader_pool& operator=(const reader_pool&) = delete;
+
+    // Check is_valid() on the result, as with reader::open().
+    handle acquire(const std::string& path, const open_mode_t mode = open_mode_t::FULL);
+    size_t idle_count();
+};
+
+}
+
+#endif
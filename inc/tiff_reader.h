@@ -8,10 +8,25 @@
 #include <functional>
 #include <type_traits>
 #include <vector>
-#include <map>
+#include <memory>
+#include <memory_resource>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+
+#include "tiff_arena.h"
+#include "tiff_bswap.h"
+#include "tiff_color.h"
+#include "tiff_jpeg.h"
+#include "tiff_stats.h"
 
 namespace tiff {
 
+struct image_stats;
+struct async_context;
+template<typename T>
+class async_op;
+
 template<typename T>
 constexpr auto enum_base_cast(T e)
     -> std::underlying_type_t<T>
@@ -56,10 +71,15 @@ enum class tag_t : uint16_t {
     PLANAR_CONFIGURATION        = 0x011C,
     RESOLUTION_UNIT             = 0x0128,
     COLOR_MAP                   = 0x0140,
+    INK_SET                     = 0x014C,
     IMAGE_DESCRIPTION           = 0x010E,
     SAMPLES_PER_PIXEL           = 0x0115,
     DATE_TIME                   = 0x0132,
     EXTRA_SAMPLES               = 0x0152,
+    JPEG_TABLES                 = 0x015B,
+    YCBCR_COEFFICIENTS          = 0x0211,
+    YCBCR_SUB_SAMPLING          = 0x0212,
+    YCBCR_POSITIONING           = 0x0213,
 };
 
 enum class compression_t : uint16_t {
@@ -91,12 +111,55 @@ enum class extra_data_t : uint16_t
     UNASSALPHA  = 2,
 };
 
+// Inks of a Separated page; only CMYK is decoded
+enum class ink_set_t : uint16_t
+{
+    CMYK        = 1,
+    NOT_CMYK    = 2,
+};
+
 enum class planar_configuration_t : uint16_t
 {
     CONTIG = 1,
     SEPARATE = 2
 };
 
+enum class open_mode_t : uint8_t
+{
+    FULL,
+    // Parse IFD scalars only. Array-valued tags (strip tables, color map)
+    // are read on the first pixel access of each page.
+    METADATA_ONLY,
+};
+
+enum class cmyk_output_t : uint8_t
+{
+    RGBA,       // converted to RGB, alpha from an extra sample if any
+    NATIVE,     // C, M, Y and K in r, g, b and a, narrowed to 8 bits; the
+                // alpha sample of CMYKA has no room left and is dropped
+};
+
+// Alpha as delivered in color_t::a, whatever the ExtraSamples tag says it
+// is stored as. Unspecified extra samples count as unassociated alpha.
+enum class alpha_output_t : uint8_t
+{
+    AS_STORED,      // samples as they are in the file
+    PREMULTIPLIED,  // colors multiplied by alpha (associated)
+    STRAIGHT,       // colors independent of alpha (unassociated)
+    DROP,           // alpha cleared to 0 as on pages without it, colors as stored
+};
+
+// How pixels are delivered by the accessors, see reader::set_decode_options()
+struct decode_options
+{
+    cmyk_output_t cmyk = cmyk_output_t::RGBA;
+    alpha_output_t alpha = alpha_output_t::AS_STORED;
+};
+
+// Pulls up to size bytes of a forward-only input into buf and returns how
+// many it got; 0 ends the input. See reader::open_stream().
+using stream_read = std::function<size_t(void* buf, size_t size)>;
+
 template<typename T, std::enable_if_t<std::is_enum<T>::value, std::nullptr_t> = nullptr>
 const char* to_string(T e);
 
@@ -134,7 +197,7 @@ public:
     static auto bswap(const T& v)
         -> std::enable_if_t<check_swappable<T, 8>::value, T>
     {
-        return T(__builtin_bswap64(*reinterpret_cast<const uint64_t*>(v)));
+        return T(__builtin_bswap64(*reinterpret_cast<const uint64_t*>(&v)));
     }
 
     template<typename T>
@@ -172,22 +235,24 @@ public:
         }
     }
 
-    template<typename T>
-    void read_array(std::vector<T>& vec, size_t start, size_t size)
+    template<typename T, typename A>
+    void read_array(std::vector<T, A>& vec, size_t start, size_t size)
     {
-        for (size_t i = start; i < start+size; i++){
-            read(vec[i]);
+        std::memcpy(vec.data() + start, static_cast<const uint8_t*>(buf_ptr) + looking, size * sizeof(T));
+        if (need_swap) {
+            bswap_array(vec.data() + start, size);
         }
+        looking += size * sizeof(T);
     }
 
-    template<typename T>
-    void read_array(std::vector<T>& vec, size_t size)
+    template<typename T, typename A>
+    void read_array(std::vector<T, A>& vec, size_t size)
     {
         read_array(vec, 0, size);
     }
 
-    template<typename T>
-    void read_array(std::vector<T>& vec)
+    template<typename T, typename A>
+    void read_array(std::vector<T, A>& vec)
     {
         read_array(vec, vec.size());
     }
@@ -216,7 +281,7 @@ struct tag_entry
 struct ifd
 {
     uint16_t entry_count;
-    std::vector<tag_entry> entries;
+    std::pmr::vector<tag_entry> entries;
     uint32_t next_ifd;
 };
 
@@ -240,109 +305,348 @@ class page
 public:
     page(page&&) noexcept = default;
     void print_info() const;
+    stats_t get_stats() const;
+    void print_stats() const;
 
     // int get_pixels(const uint32_t i, const uint32_t l, color_t *buf) const;
-    int get_pixels(const uint16_t, const uint16_t y, const size_t l, color_t *pixs) const;
-    color_t get_pixel(const uint16_t x, const uint16_t y) const;
-    color_t get_pixel_without_buffering(const uint16_t x, const uint16_t y) const;
-
-    ~page() {
-        if (buffer_id != -1) {
-            release_page_id(buffer_id);
-        }
+    // Decodes l pixels starting at (x, y); they are read as one contiguous run.
+    int get_pixels(const uint32_t x, const uint32_t y, const size_t l, color_t *pixs) const;
+    // Decodes the w x h rectangle at (x, y), clipped to the image, into pixs
+    // with rows `stride` pixels apart (0 means w). Only the bytes of the
+    // rectangle are read; rows close together in the file share one read.
+    // Returns the number of rows decoded.
+    int get_region(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h, color_t *pixs, size_t stride = 0) const;
+    // get_region() that also counts the decoded pixels into s while each
+    // read is still in cache; 16-bit pages are counted from the file
+    // samples at full depth. s may carry counts of earlier regions of pages
+    // with the same depth and channels (see tiff_histogram.h).
+    int get_region_stats(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h, color_t *pixs,
+            size_t stride, image_stats& s) const;
+    color_t get_pixel(const uint32_t x, const uint32_t y) const;
+    color_t get_pixel_without_buffering(const uint32_t x, const uint32_t y) const;
+    // Whether the accessors deliver an alpha sample in color_t::a; pages
+    // without one leave it at 0. Follows decode_options::alpha.
+    bool has_alpha() const;
+
+    // Decodes up to n pixels of row y from x in chunks of at most
+    // line_chunk_pixels, handing each chunk and its offset in the run to
+    // sink. The file bytes and decoded pixels only pass through buffers on
+    // the stack, so no heap memory is used; JPEG pages are the exception
+    // and decode through a per-thread row. Returns the pixels decoded.
+    static constexpr size_t line_chunk_pixels = 64;
+    using line_sink = void (*)(const color_t* pixs, const size_t offset, const size_t n, void* ctx);
+    int get_line_chunked(const uint32_t x, const uint32_t y, const size_t n, line_sink sink, void* ctx) const;
+
+    // Reads the array-valued tags deferred by open_mode_t::METADATA_ONLY and
+    // builds the decode tables (row offsets, sample lookup), which every
+    // page leaves to its first access so opening long stacks stays cheap.
+    // The pixel accessors call it on demand; it is a no-op once loaded.
+    bool load_deferred() const;
+    bool is_deferred() const
+    {
+        return deferred.pending.load(std::memory_order_acquire);
+    }
+    // False for a later page of the file the reader cannot decode, such as
+    // an unsupported thumbnail or mask. Its tags are kept but it decodes
+    // nothing; the pages after it are unaffected.
+    bool is_valid() const
+    {
+        return valid;
     }
 
+    // Awaitable forms of load_deferred(), of get_region() over rows y to
+    // y + count - 1 into pixs with rows width pixels apart, and of
+    // get_region() (see tiff_async.h). The page and pixs must stay valid
+    // until the op completes.
+    async_op<bool> load_async(const async_context& ctx) const;
+    async_op<int> read_rows_async(const uint32_t y, const uint32_t count, color_t *pixs,
+            const async_context& ctx) const;
+    async_op<int> get_region_async(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h,
+            color_t *pixs, size_t stride, const async_context& ctx) const;
+
     bool validate()
     {
         byte_per_pixel = calc_byte_per_pixel(sample_per_pixel, bit_per_samples);
-        return validate_bit_per_samples(sample_per_pixel, bit_per_samples);
+        const bool ok = validate_bit_per_samples(sample_per_pixel, bit_per_samples);
+        layout = calc_pixel_layout();
+        deferred.pending.store(true, std::memory_order_release);
+        // Compressed, YCbCr and CMYK samples are only understood in their own layouts
+        if (compression != compression_t::NONE) return ok && layout == pixel_layout_t::JPEG;
+        if (colorspace == colorspace_t::YCBCR && layout != pixel_layout_t::YCBCR) return false;
+        if (colorspace == colorspace_t::SEPARATED && layout != pixel_layout_t::CMYK) return false;
+        return ok;
     }
 
 private:
-    page(const class reader& r) :
-        r(r), buffer_id(reserve_page_id()),
-        bit_per_samples({1}), sample_per_pixel(1), extra_sample_counts(0),
-        planar_configuration(planar_configuration_t::CONTIG)
-    {}
-
-    static int32_t reserve_page_id();
-    static void release_page_id(const int32_t id);
+    page(const class reader& r);
 
+    // Reads len_bits bits starting pos bits into buffer, MSB first. Only the
+    // bytes covering those bits are touched.
     template<typename T>
     static T extract_memory(const void* buffer, const uint16_t pos, const uint16_t len_bits)
     {
         const auto bytes = reinterpret_cast<const uint8_t*>(buffer);
 
-        const uint16_t eb = pos + len_bits;
-        const uint16_t se = pos / 8;
-        const uint16_t ee = eb / 8;
+        const uint32_t eb = pos + len_bits;
+        uint64_t ret = 0;
+        for (uint32_t e = pos / 8; e < (eb + 7) / 8; e++) {
+            ret = (ret << 8) | bytes[e];
+        }
+        ret >>= (8 - eb % 8) % 8;
+        if (len_bits < 64) {
+            ret &= (uint64_t(1) << len_bits) - 1;
+        }
 
-        const uint8_t ee_len = eb % 8;
-        const uint16_t incld_full_bytes = ee - se - 1;
+        return static_cast<T>(ret);
+    }
 
-        T ret = 0;
-        for (uint16_t e = se, i = 0; e <= ee; e++, i++) {
-            if (e == ee) {
-                ret |= bytes[e] >> (8 - ee_len);
-            } else {
-                ret |= bytes[e] << ((incld_full_bytes - i) * 8 + ee_len);
-            }
+    static uint8_t calc_byte_per_pixel(const uint16_t sample_per_pixel, const std::pmr::vector<uint16_t> &bit_per_samples);
+    static bool validate_bit_per_samples(const uint16_t sample_per_pixel, std::pmr::vector<uint16_t> &bit_per_samples);
+
+    // Sample layouts with a dedicated decode path, decided once in validate()
+    enum class pixel_layout_t : uint8_t
+    {
+        GENERIC,
+        RGBA8,          // already laid out as color_t
+        SAMPLES16,      // 16-bit samples, up to 4 per pixel
+        GRAY_ALPHA,
+        INDEXED,        // one 1/2/4/8-bit sample mapped through sample_lut
+        YCBCR,          // 8-bit YCbCr in data units of block_cols x block_rows
+        CMYK,           // 8- or 16-bit inks, optionally followed by alpha
+        JPEG,           // compression 7, decoded strip by strip
+    };
+    pixel_layout_t calc_pixel_layout() const;
+    void build_sample_lut();
+    // Derives the addressing and decode state from the parsed tags
+    void prepare_decode();
+    // Marks the page undecodable and drops its strips and deferred tags, so
+    // no accessor reads anything for it
+    void invalidate();
+    // Decodes n pixels of one row starting at `phase` (see pixel_addr) in src.
+    // sub_row picks the line within a YCbCr data unit.
+    void decode_run(const uint8_t* src, const uint8_t phase, const uint8_t sub_row, const size_t n, color_t* dst) const;
+    void decode_samples(const uint8_t* src, const uint8_t phase, const uint8_t sub_row, const size_t n,
+            color_t* dst) const;
+    // Whether the decoded samples put an alpha sample in color_t::a
+    bool stores_alpha() const;
+    // What convert_alpha() does to this page's pixels: the mode of
+    // decode_options::alpha, or AS_STORED when it changes nothing
+    alpha_output_t alpha_conversion() const;
+    // Brings decoded pixels to decode_options::alpha
+    void convert_alpha(color_t* pixs, const size_t n) const;
+    void decode_ycbcr(const uint8_t* src, const uint8_t phase, const uint8_t sub_row, const size_t n, color_t* dst) const;
+    void decode_cmyk(const uint8_t* src, const size_t n, color_t* dst) const;
+
+    // Compressed pages have no byte address per pixel; their accessors
+    // decode whole strips and keep what was asked for.
+    bool decode_strip_rows(const uint32_t strip, const uint32_t y0, const uint32_t y1,
+            const uint32_t x, const uint32_t w, color_t* dst, const size_t stride) const;
+    int get_region_compressed(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h,
+            color_t* pixs, size_t stride, image_stats* hist = nullptr) const;
+    int decode_region(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h,
+            color_t* pixs, size_t stride, image_stats* hist) const;
+    // Sizes empty stats for this page, or checks that s matches it
+    bool prepare_stats(image_stats& s) const;
+    color_t get_pixel_compressed(const uint32_t x, const uint32_t y) const;
+
+    // Where a pixel lives: file offset of the first byte holding it, and the
+    // phase of the pixel from there. For packed formats the phase is the bit
+    // offset of its first sample (non-zero for sub-byte formats); for
+    // subsampled YCbCr pos is its data unit and the phase is the column
+    // within the unit, sub_row the line.
+    struct pixel_addr
+    {
+        uint64_t pos;
+        uint8_t phase;
+        uint8_t sub_row;
+    };
+    bool locate(const uint32_t x, const uint32_t y, pixel_addr& a) const;
+    // Bytes covering n pixels of one row that start at `phase`
+    size_t span_bytes(const uint8_t phase, const size_t n) const
+    {
+        if (layout == pixel_layout_t::YCBCR) {
+            return (phase + n + block_cols - 1) / block_cols * unit_bytes;
         }
+        return (phase + n * bit_per_pixel + 7) / 8;
+    }
 
-        return ret;
+    size_t fread_pos(void* dest, const uint64_t pos, const size_t size) const;
+    void io_lock() const;
+    void io_unlock() const;
+
+    void ensure_loaded() const
+    {
+        if (is_deferred()) {
+            load_deferred();
+        }
     }
 
-    static uint8_t calc_byte_per_pixel(const uint16_t sample_per_pixel, const std::vector<uint16_t> &bit_per_samples);
-    static bool validate_bit_per_samples(const uint16_t sample_per_pixel, std::vector<uint16_t> &bit_per_samples);
+    struct deferred_entries
+    {
+        std::atomic<bool> pending{false};
+        std::pmr::vector<tag_entry> entries;
+
+        deferred_entries(std::pmr::memory_resource* mr) : entries(mr) {}
+        deferred_entries(deferred_entries&& o) noexcept :
+            pending(o.pending.load()), entries(std::move(o.entries))
+        {}
+    };
+
+    // Stack space get_line_chunked() reads file bytes into
+    static constexpr size_t line_chunk_bytes = 512;
+
+    // Bytes around the last pixel read by get_pixel(), guarded by the
+    // reader's io lock.
+    static constexpr size_t pixel_cache_size = 128;
+    struct pixel_cache
+    {
+        uint8_t data[pixel_cache_size];
+        uint64_t start = 0;
+        size_t len = 0;
+    };
 
     const class reader& r;
+    mutable stats_counter stats;
+    mutable deferred_entries deferred;
+    mutable pixel_cache cache;
+    bool valid = true;
 
 public:
-    int32_t buffer_id;
 
     uint32_t width;
     uint32_t height;
-    std::vector<uint16_t> bit_per_samples;
+    std::pmr::vector<uint16_t> bit_per_samples;
     uint16_t sample_per_pixel;
     uint16_t byte_per_pixel;
     compression_t compression;
     colorspace_t colorspace;
-    std::vector<uint16_t> color_palette;
+    std::pmr::vector<uint16_t> color_palette;
 
-    std::vector<uint32_t> strip_offsets;
+    std::pmr::vector<uint32_t> strip_offsets;
     uint32_t rows_per_strip;
-    std::vector<uint32_t> strip_byte_counts;
+    std::pmr::vector<uint32_t> strip_byte_counts;
     uint32_t extra_sample_counts;
     extra_data_t extra_sample_type;
     rational_t x_resolution;
     rational_t y_resolution;
     planar_configuration_t planar_configuration;
+    ink_set_t ink_set;
+    // Horizontal and vertical chroma subsampling, and the luma weights of
+    // R, G and B. Only meaningful for YCbCr.
+    uint16_t ycbcr_sub_sampling[2];
+    rational_t ycbcr_coefficients[3];
+    // Quantization and Huffman tables shared by the JPEG strips
+    std::pmr::vector<uint8_t> jpeg_tables;
+
+    std::pmr::string description;
+    std::pmr::string date_time;
 
-    std::string description;
-    std::string date_time;
+private:
+    pixel_layout_t layout = pixel_layout_t::GENERIC;
+    uint32_t bit_per_pixel = 0;
+    // Rows are padded to whole bytes, so sub-byte rows need their own stride.
+    // For YCbCr it is the stride of a row of data units.
+    uint64_t row_bytes = 0;
+    uint32_t strip_rows = 0;
+    // Size of a YCbCr data unit in pixels and bytes; 1 x 1 for other layouts.
+    uint8_t block_cols = 1;
+    uint8_t block_rows = 1;
+    uint16_t unit_bytes = 0;
+    ycbcr_factors ycbcr = {};
+    // Unique per prepare_decode(), so per-thread caches of decoded strips
+    // never mistake a page at a reused address for this one.
+    uint64_t decode_id = 0;
+    // File offset of every row that has a strip, so locating a pixel needs
+    // neither the strip division nor the row multiply. Rows sharing YCbCr
+    // data units share an offset.
+    std::pmr::vector<uint64_t> row_base;
+    std::pmr::vector<color_t> sample_lut;
 };
 
+class scratch_buffer;
+
 class reader {
-    friend color_t page::get_pixel(const uint16_t, const uint16_t) const;
-    friend color_t page::get_pixel_without_buffering(const uint16_t, const uint16_t) const;
-    friend int page::get_pixels(const uint16_t x, const uint16_t y, const size_t l, color_t *pixs) const;
+    friend class scratch_buffer;
+    friend color_t page::get_pixel(const uint32_t, const uint32_t) const;
+    friend color_t page::get_pixel_without_buffering(const uint32_t, const uint32_t) const;
+    friend int page::get_pixels(const uint32_t x, const uint32_t y, const size_t l, color_t *pixs) const;
+    friend void page::decode_samples(const uint8_t* src, const uint8_t phase, const uint8_t sub_row, const size_t n,
+            color_t* dst) const;
+    friend int page::decode_region(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h,
+            color_t* pixs, size_t stride, image_stats* hist) const;
+    friend void page::decode_cmyk(const uint8_t* src, const size_t n, color_t* dst) const;
+    friend bool page::decode_strip_rows(const uint32_t strip, const uint32_t y0, const uint32_t y1,
+            const uint32_t x, const uint32_t w, color_t* dst, const size_t stride) const;
+    friend size_t page::fread_pos(void* dest, const uint64_t pos, const size_t size) const;
+    friend void page::io_lock() const;
+    friend void page::io_unlock() const;
+    friend bool page::load_deferred() const;
+    friend void page::prepare_decode();
 private:
-    const std::string path;
+    std::string path;
+    // Sidecar index of open_indexed(), empty for plain readers
+    std::string index_path;
+    open_mode_t mode;
     intptr_t source;
+    // Set for readers made by open_memory(); the bytes are borrowed.
+    const uint8_t* memory = nullptr;
+    // Set for readers made by open_stream() (tiff_stream.cpp)
+    struct stream_state;
+    struct stream_deleter
+    {
+        void operator()(stream_state* s) const;
+    };
+    std::unique_ptr<stream_state, stream_deleter> stream;
+    uint64_t source_size = 0;
+    // Where the file is positioned after the last read, so reads that
+    // continue it skip the seek; guarded by the io lock.
+    mutable uint64_t file_pos = UINT64_MAX;
+    // Keeps each seek/read pair atomic. It is per reader, so readers on
+    // different files never wait for each other.
+    std::unique_ptr<std::mutex> io_mtx;
+    // Serializes page::load_deferred(), which allocates from the arena
+    std::unique_ptr<std::mutex> load_mtx;
 
     endian_t endi;
     bool need_swap;
 
+    // Backs every metadata container of this reader and its pages; it is
+    // released in one go when the reader is destroyed and rewound by reset().
+    std::unique_ptr<arena_resource> arena;
+    // Enough for the IFD and strip tables of a typical single-page file, so
+    // small opens are served by a single upstream allocation.
+    static constexpr size_t arena_initial_size = 4096;
+
+    // Staging bytes for strip and IFD reads, allocated from the arena's
+    // upstream: pages give them back right after the read, which the arena
+    // would never reuse. One spare block is kept for the next read; callers
+    // that find it taken, on other threads, allocate their own.
+    struct alignas(std::max_align_t) scratch_block
+    {
+        size_t capacity;
+    };
+    mutable std::atomic<scratch_block*> spare_scratch{nullptr};
+
     header h;
-    std::vector<ifd> ifds;
+    std::pmr::vector<ifd> ifds;
     bool decoded = false;
 
-    std::vector<page> pages;
+    std::pmr::vector<page> pages;
+
+    mutable stats_counter stats;
+    decode_options options;
 
 private:
-    reader(const std::string& path);
+    reader(const std::string& path, const open_mode_t mode, std::pmr::memory_resource* upstream,
+            const std::string& index_path = "");
+    reader(const void* data, const size_t size, const open_mode_t mode, std::pmr::memory_resource* upstream);
+    reader(stream_read read, const size_t max_spool, std::pmr::memory_resource* upstream);
 
+    bool load();
     bool read_header();
+    scratch_block* take_scratch(const size_t size) const;
+    void give_scratch(scratch_block* b) const;
+    void free_scratch(scratch_block* b) const;
     inline static bool platform_is_little_endian()
     {
         uint32_t t = 1;
@@ -354,50 +658,137 @@ private:
     }
 
     static endian_t check_endian_type(const char s[2]);
-    size_t fread_pos(void* dest, const size_t pos, const size_t size) const;
-    template<typename T>
-    void fread_array_buffering(std::vector<T>& vec, const size_t count, void* buffer, const size_t bufsize, const size_t pos) const
+    size_t fread_pos(void* dest, const uint64_t pos, const size_t size) const;
+    void io_lock() const;
+    void io_unlock() const;
+    // Reads a whole array with one fread_pos and swaps it in bulk. Callers
+    // hold the io lock.
+    template<typename T, typename A>
+    void fread_array(std::vector<T, A>& vec, const size_t count, const size_t pos) const
     {
-        buffer_reader rd(buffer, need_swap);
-        uint32_t total = count * sizeof(T);
-        uint32_t look = 0;
-        while(total-look > 0) {
-            uint32_t size
-                = std::min(static_cast<uint32_t>((bufsize / sizeof(T))*sizeof(T)), total-look);
-            fread_pos(buffer, pos+look, size);
-            rd.read_array(vec, look/sizeof(T), size/sizeof(T));
-            rd.seek_top();
-            look += size;
+        fread_pos(vec.data(), pos, count * sizeof(T));
+        if (need_swap) {
+            bswap_array(vec.data(), count);
         }
     }
 
-    template<typename T>
-    void fread_array_buffering(std::vector<T>& vec, void* buffer, const size_t bufsize, const size_t pos) const
+    template<typename T, typename A>
+    void fread_array(std::vector<T, A>& vec, const size_t pos) const
     {
-        fread_array_buffering(vec, vec.size(), buffer, bufsize, pos);
+        fread_array(vec, vec.size(), pos);
     }
     bool decode();
+    // Fills the pages from index_path when it matches the file (tiff_sidecar.cpp)
+    bool load_index();
+    // fread_pos() of stream readers, and the switch from parsing to reading
+    // strips once the first page is known (tiff_stream.cpp)
+    size_t read_stream(void* dest, const uint64_t pos, const size_t size) const;
+    bool end_stream_parse();
+    // Most bytes one read can return: the source, or what a stream may spool
+    uint64_t read_limit() const;
 
 public:
     ~reader();
-    reader(reader&&) = default;
-    static reader open(const std::string& path);
-    static reader *open_ptr(const std::string& path);
+    // Pages refer to their reader, so it stays where it was opened
+    reader(reader&&) = delete;
+    reader& operator=(reader&&) = delete;
+    // upstream feeds the reader's metadata arena and the buffers its reads
+    // are staged in; nullptr means the default resource. Pages decoded on
+    // several threads allocate from it concurrently.
+    static reader open(const std::string& path, const open_mode_t mode = open_mode_t::FULL,
+            std::pmr::memory_resource* upstream = nullptr);
+    static reader *open_ptr(const std::string& path, const open_mode_t mode = open_mode_t::FULL,
+            std::pmr::memory_resource* upstream = nullptr);
+    // Parses size bytes at data instead of a file. The bytes are not copied
+    // and must outlive the reader.
+    static reader open_memory(const void* data, const size_t size, const open_mode_t mode = open_mode_t::FULL,
+            std::pmr::memory_resource* upstream = nullptr);
+    // Parses input that can only be read forward, such as a pipe, pulling
+    // it through read. Only the first IFD is read: reaching a later one
+    // would mean holding every strip in between. Bytes are kept while the
+    // IFD and its tag data are parsed, so strips written before the IFD
+    // stay available, up to max_spool bytes. After that each read releases
+    // what lies behind it and skips the input forward without storing it,
+    // so reading the page top to bottom runs in constant memory. A page
+    // whose strips are not in file order keeps spooling, bounded the same
+    // way. Reads behind released bytes return zeros.
+    static reader open_stream(stream_read read, const size_t max_spool = size_t(64) << 20,
+            std::pmr::memory_resource* upstream = nullptr);
+    // open_ptr() run on ctx.io; check is_valid() on the result
+    static async_op<std::unique_ptr<reader>> open_async(const std::string& path, const async_context& ctx,
+            const open_mode_t mode = open_mode_t::FULL, std::pmr::memory_resource* upstream = nullptr);
+
+    // Opens path backed by a sidecar index at index_path, or path + ".tidx"
+    // when it is empty. An index matching the file's size and modification
+    // time replaces the IFD walk and every tag read: it is mapped and the
+    // pages are copied out of it. Otherwise the file is parsed in full and
+    // the index is written for the next open.
+    static reader open_indexed(const std::string& path, const std::string& index_path = "",
+            const open_mode_t mode = open_mode_t::FULL, std::pmr::memory_resource* upstream = nullptr);
+    // Writes the sidecar index of this file, loading deferred tags first.
+    // Tags without a built-in proc are kept so custom procs see them again.
+    bool save_index(const std::string& index_path) const;
+
+    // Reopens this reader on another file, reusing the capacity of its arena
+    // so a warm reader allocates close to nothing per file.
+    bool reset(const std::string& path, const open_mode_t mode = open_mode_t::FULL);
+    void close();
 
     bool is_valid() const;
     bool is_big_endian() const;
     bool is_little_endian() const;
-    void fetch_ifds(std::vector<ifd> &ifds) const;
-    bool read_entry_tags(const std::vector<ifd> &ifds, std::vector<page> &pages);
+    bool fetch_ifds(std::pmr::vector<ifd> &ifds) const;
+    bool read_entry_tags(const std::pmr::vector<ifd> &ifds, std::pmr::vector<page> &pages);
     const page& get_page(uint32_t index) &;
     uint32_t get_page_count() const;
+    std::pmr::memory_resource* get_memory_resource() const;
+    // Size of the file or memory block; reads past it return zeros.
+    // Streams have no known size and report UINT64_MAX.
+    uint64_t get_source_size() const;
+
+    // Applies to every page of this reader and survives reset(). Set it
+    // before decoding; it is not synchronized with running accessors.
+    void set_decode_options(const decode_options& opt);
+    const decode_options& get_decode_options() const;
 
     void print_header() const;
+    stats_t get_stats() const;
+    void print_stats() const;
+    void reset_stats();
 
 public:
-    const static std::map<tag_t, std::function<bool(const reader&, const tag_entry&, page&)>> tag_procs;
+    using tag_proc_t = bool (*)(const reader&, const tag_entry&, page&);
+    using custom_tag_proc_t = std::function<bool(const reader&, const tag_entry&, page&)>;
+
+    // Hooks for tags the reader does not handle itself; the built-in tags
+    // always take precedence. They may be changed while other threads open
+    // files, and an open sees each hook as it was when the tag was reached.
+    static void register_tag_proc(tag_t tag, custom_tag_proc_t proc);
+    static void unregister_tag_proc(tag_t tag);
+
+    // Helpers for custom tag procs. read_tag_bytes copies the raw field data
+    // in file byte order, whether it is stored inline or out of line.
+    uint32_t read_tag_scalar(const tag_entry& e) const;
+    size_t read_tag_bytes(const tag_entry& e, void* dest, const size_t size) const;
 
 private:
+    struct tag_proc_entry
+    {
+        tag_t tag;
+        tag_proc_t proc;
+    };
+    struct custom_tag_proc_entry
+    {
+        tag_t tag;
+        custom_tag_proc_t proc;
+    };
+    static std::vector<custom_tag_proc_entry> custom_tag_procs;
+    static std::shared_mutex custom_tag_procs_mtx;
+    static tag_proc_t find_tag_proc(tag_t tag);
+    static bool is_deferrable_tag(const tag_entry& e);
+    // A copy, so the proc runs without holding the lock; empty when none
+    static custom_tag_proc_t find_custom_tag_proc(tag_t tag);
+
     struct tag_manager
     {
         template<typename T>
@@ -427,6 +818,12 @@ private:
             return 0;
         }
 
+        // Rejects arrays longer than the whole source before they are allocated
+        static bool fits_in_source(const reader& r, const tag_entry& e, const size_t elem_size)
+        {
+            return e.field_count <= r.read_limit() / elem_size;
+        }
+
         static bool image_width(const reader&, const tag_entry&, page&);
         static bool image_length(const reader&, const tag_entry&, page&);
         static bool bits_per_sample(const reader&, const tag_entry&, page&);
@@ -440,10 +837,14 @@ private:
         static bool planar_configuration(const reader&, const tag_entry&, page&);
         static bool resolution_unit(const reader&, const tag_entry&, page&);
         static bool color_map(const reader&, const tag_entry&, page&);
+        static bool ink_set(const reader&, const tag_entry&, page&);
         static bool image_description(const reader&, const tag_entry&, page&);
         static bool samples_per_pixel(const reader&, const tag_entry&, page&);
         static bool date_time(const reader&, const tag_entry&, page&);
         static bool extra_samples(const reader&, const tag_entry&, page&);
+        static bool jpeg_tables(const reader&, const tag_entry&, page&);
+        static bool ycbcr_coefficients(const reader&, const tag_entry&, page&);
+        static bool ycbcr_sub_sampling(const reader&, const tag_entry&, page&);
     };
 };
 
@@ -0,0 +1,137 @@
+#ifndef __TIFF_STATS_H
+#define __TIFF_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace tiff {
+
+#ifdef TIFF_READER_ENABLE_STATS
+constexpr bool stats_enabled = true;
+#else
+constexpr bool stats_enabled = false;
+#endif
+
+// Snapshot of the hot-path counters of a reader or a page.
+// Everything stays zero unless built with TIFF_READER_ENABLE_STATS.
+struct stats_t
+{
+    uint64_t read_calls = 0;        // fread_pos calls, each one seek + one read
+    uint64_t bytes_read = 0;
+    uint64_t buffer_hits = 0;       // get_pixel served from the pixel buffer
+    uint64_t buffer_misses = 0;
+    uint64_t strip_loads = 0;       // strip chunks fetched for pixel decode
+    uint64_t strip_load_ns = 0;
+    uint64_t lock_count = 0;
+    uint64_t lock_wait_ns = 0;
+
+    double hit_rate() const;
+    void print() const;
+};
+
+template<bool Enabled>
+class basic_stats_counter;
+
+// Disabled: every hook is an empty inline function and the member takes no space.
+template<>
+class basic_stats_counter<false>
+{
+public:
+    using time_point = int;
+    static time_point now() { return 0; }
+
+    void count_read(size_t) {}
+    void count_hit() {}
+    void count_miss() {}
+    void count_strip_load(time_point) {}
+    void count_lock(time_point) {}
+    stats_t snapshot() const { return {}; }
+    void reset() {}
+};
+
+template<>
+class basic_stats_counter<true>
+{
+private:
+    using clock = std::chrono::steady_clock;
+
+    std::atomic<uint64_t> read_calls{0};
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> buffer_hits{0};
+    std::atomic<uint64_t> buffer_misses{0};
+    std::atomic<uint64_t> strip_loads{0};
+    std::atomic<uint64_t> strip_load_ns{0};
+    std::atomic<uint64_t> lock_count{0};
+    std::atomic<uint64_t> lock_wait_ns{0};
+
+    static void add(std::atomic<uint64_t>& c, uint64_t v)
+    {
+        c.fetch_add(v, std::memory_order_relaxed);
+    }
+    static uint64_t elapsed_ns(clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+
+public:
+    using time_point = clock::time_point;
+    static time_point now() { return clock::now(); }
+
+    basic_stats_counter() = default;
+    basic_stats_counter(const basic_stats_counter& o) { *this = o; }
+    basic_stats_counter& operator=(const basic_stats_counter& o)
+    {
+        const stats_t s = o.snapshot();
+        read_calls = s.read_calls;
+        bytes_read = s.bytes_read;
+        buffer_hits = s.buffer_hits;
+        buffer_misses = s.buffer_misses;
+        strip_loads = s.strip_loads;
+        strip_load_ns = s.strip_load_ns;
+        lock_count = s.lock_count;
+        lock_wait_ns = s.lock_wait_ns;
+        return *this;
+    }
+
+    void count_read(size_t bytes)
+    {
+        add(read_calls, 1);
+        add(bytes_read, bytes);
+    }
+    void count_hit() { add(buffer_hits, 1); }
+    void count_miss() { add(buffer_misses, 1); }
+    void count_strip_load(time_point start)
+    {
+        add(strip_loads, 1);
+        add(strip_load_ns, elapsed_ns(start));
+    }
+    void count_lock(time_point start)
+    {
+        add(lock_count, 1);
+        add(lock_wait_ns, elapsed_ns(start));
+    }
+
+    stats_t snapshot() const
+    {
+        stats_t s;
+        s.read_calls = read_calls.load(std::memory_order_relaxed);
+        s.bytes_read = bytes_read.load(std::memory_order_relaxed);
+        s.buffer_hits = buffer_hits.load(std::memory_order_relaxed);
+        s.buffer_misses = buffer_misses.load(std::memory_order_relaxed);
+        s.strip_loads = strip_loads.load(std::memory_order_relaxed);
+        s.strip_load_ns = strip_load_ns.load(std::memory_order_relaxed);
+        s.lock_count = lock_count.load(std::memory_order_relaxed);
+        s.lock_wait_ns = lock_wait_ns.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    void reset() { *this = basic_stats_counter(); }
+};
+
+using stats_counter = basic_stats_counter<stats_enabled>;
+
+}
+
+#endif
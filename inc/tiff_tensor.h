@@ -0,0 +1,60 @@
+#ifndef __TIFF_TENSOR_H
+#define __TIFF_TENSOR_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "tiff_reader.h"
+
+namespace tiff {
+
+enum class tensor_layout_t : uint8_t
+{
+    PLANAR,         // CHW: one plane per channel
+    INTERLEAVED,    // HWC: channels of a pixel side by side
+};
+
+enum class tensor_type_t : uint8_t
+{
+    FLOAT32,
+    UINT8,          // rounded and clamped to 0-255
+};
+
+struct tensor_options
+{
+    tensor_layout_t layout = tensor_layout_t::PLANAR;
+    tensor_type_t type = tensor_type_t::FLOAT32;
+    // Output channel i is taken from channel_map[i] of the decoded pixel
+    // (0 r, 1 g, 2 b, 3 a), so {2, 1, 0} gives BGR and {0} a single plane.
+    uint8_t channels = 3;
+    uint8_t channel_map[4] = {0, 1, 2, 3};
+    // Applied per output channel to the 0-255 sample: v * scale + offset
+    float scale[4] = {1, 1, 1, 1};
+    float offset[4] = {0, 0, 0, 0};
+    // Output size, 0 for the page's own. A different size resizes the
+    // image bilinearly; with keep_aspect it is fitted inside and centred,
+    // and the border is filled with pad (written as is, not scaled).
+    uint32_t width = 0;
+    uint32_t height = 0;
+    bool keep_aspect = true;
+    float pad = 0;
+
+    // Sets scale and offset to compute (v / 255 - mean[i]) / stddev[i] for
+    // each output channel, the usual normalization of training pipelines.
+    void normalize(const float* mean, const float* stddev);
+};
+
+uint32_t tensor_width(const page& p, const tensor_options& opt);
+uint32_t tensor_height(const page& p, const tensor_options& opt);
+// Bytes decode_tensor() writes for page p
+size_t tensor_bytes(const page& p, const tensor_options& opt);
+
+// Decodes the page straight into out, which holds tensor_bytes() bytes.
+// Rows are decoded in small bands and written to the tensor while they are
+// still in cache; selection, scale/offset and resize happen in the same
+// pass. Returns false for invalid options or when rows fail to decode.
+bool decode_tensor(const page& p, const tensor_options& opt, void* out);
+
+}
+
+#endif
@@ -0,0 +1,57 @@
+#include "tiff_arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace tiff {
+
+arena_resource::arena_resource(const size_t initial_size, std::pmr::memory_resource* upstream) :
+    upstream(upstream), next_size(initial_size)
+{}
+
+arena_resource::~arena_resource()
+{
+    for (auto& b: blocks) {
+        upstream->deallocate(b.data, b.size, alignof(std::max_align_t));
+    }
+}
+
+void arena_resource::rewind()
+{
+    current = 0;
+    used = 0;
+}
+
+size_t arena_resource::capacity() const
+{
+    size_t total = 0;
+    for (auto& b: blocks) {
+        total += b.size;
+    }
+    return total;
+}
+
+void* arena_resource::do_allocate(size_t bytes, size_t alignment)
+{
+    for (; current < blocks.size(); current++, used = 0) {
+        const auto base = reinterpret_cast<uintptr_t>(blocks[current].data);
+        const uintptr_t p = (base + used + alignment - 1) & ~(uintptr_t(alignment) - 1);
+        if (p + bytes <= base + blocks[current].size) {
+            used = p + bytes - base;
+            return reinterpret_cast<void*>(p);
+        }
+    }
+
+    const size_t size = std::max(next_size, bytes + alignment);
+    auto data = static_cast<std::byte*>(upstream->allocate(size, alignof(std::max_align_t)));
+    blocks.push_back({data, size});
+    next_size = size * 2;
+
+    current = blocks.size() - 1;
+    const auto base = reinterpret_cast<uintptr_t>(data);
+    const uintptr_t p = (base + alignment - 1) & ~(uintptr_t(alignment) - 1);
+    used = p + bytes - base;
+    return reinterpret_cast<void*>(p);
+}
+
+}
@@ -0,0 +1,79 @@
+#include "tiff_async.h"
+
+#include <algorithm>
+
+namespace tiff {
+
+thread_pool_executor::thread_pool_executor(const unsigned threads)
+{
+    const unsigned n = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    this->threads.reserve(n);
+    for (unsigned i = 0; i < n; i++) {
+        this->threads.emplace_back([this]() { work(); });
+    }
+}
+
+thread_pool_executor::~thread_pool_executor()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& t: threads) {
+        t.join();
+    }
+}
+
+void thread_pool_executor::post(std::function<void()> fn)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        queue.push_back(std::move(fn));
+    }
+    cv.notify_one();
+}
+
+void thread_pool_executor::work()
+{
+    for (;;) {
+        std::function<void()> fn;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            fn = std::move(queue.front());
+            queue.pop_front();
+        }
+        fn();
+    }
+}
+
+async_op<std::unique_ptr<reader>> reader::open_async(const std::string& path, const async_context& ctx,
+        const open_mode_t mode, std::pmr::memory_resource* upstream)
+{
+    return async_op<std::unique_ptr<reader>>([path, mode, upstream]() {
+        return std::unique_ptr<reader>(open_ptr(path, mode, upstream));
+    }, ctx);
+}
+
+async_op<bool> page::load_async(const async_context& ctx) const
+{
+    return async_op<bool>([this]() { return load_deferred(); }, ctx);
+}
+
+async_op<int> page::read_rows_async(const uint32_t y, const uint32_t count, color_t *pixs,
+        const async_context& ctx) const
+{
+    return async_op<int>([this, y, count, pixs]() { return get_region(0, y, width, count, pixs); }, ctx);
+}
+
+async_op<int> page::get_region_async(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h,
+        color_t *pixs, size_t stride, const async_context& ctx) const
+{
+    return async_op<int>([this, x, y, w, h, pixs, stride]() {
+        return get_region(x, y, w, h, pixs, stride);
+    }, ctx);
+}
+
+}
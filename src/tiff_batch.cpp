@@ -0,0 +1,217 @@
+#include "tiff_batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace tiff {
+
+// Output a row task aims for when batch_options::rows_per_task is 0
+constexpr size_t batch_task_bytes = 256 * 1024;
+
+namespace {
+
+// One deque per worker. The owner pushes and pops at the back, so the rows
+// of the image it just opened stay hot in its cache; thieves take the
+// oldest task from the front.
+class work_stealing_pool
+{
+public:
+    using task = std::function<void(unsigned)>;
+
+    explicit work_stealing_pool(const unsigned threads) : queues(threads) {}
+
+    unsigned size() const
+    {
+        return queues.size();
+    }
+
+    // Tasks push follow-up work with the index they were given.
+    void push(const unsigned worker, task t)
+    {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(queues[worker].mtx);
+            queues[worker].tasks.push_back(std::move(t));
+        }
+        queued.fetch_add(1, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(idle_mtx);
+        idle_cv.notify_one();
+    }
+
+    // Returns once every task, including the ones spawned by tasks, is done.
+    void run()
+    {
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < queues.size(); i++) {
+            threads.emplace_back([this, i]() { work(i); });
+        }
+        work(0);
+        for (auto& t: threads) {
+            t.join();
+        }
+    }
+
+private:
+    struct queue
+    {
+        std::mutex mtx;
+        std::deque<task> tasks;
+    };
+    std::vector<queue> queues;
+    std::atomic<size_t> pending{0};     // queued or running
+    std::atomic<size_t> queued{0};
+    std::mutex idle_mtx;
+    std::condition_variable idle_cv;
+
+    bool pop(const unsigned worker, task& t)
+    {
+        const unsigned n = queues.size();
+        for (unsigned i = 0; i < n; i++) {
+            auto& q = queues[(worker + i) % n];
+            std::lock_guard<std::mutex> lock(q.mtx);
+            if (q.tasks.empty()) continue;
+            if (i == 0) {
+                t = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                t = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    void work(const unsigned worker)
+    {
+        for (;;) {
+            task t;
+            if (pop(worker, t)) {
+                t(worker);
+                if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    std::lock_guard<std::mutex> lock(idle_mtx);
+                    idle_cv.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_mtx);
+            idle_cv.wait(lock, [this]() {
+                return queued.load(std::memory_order_acquire) > 0 || pending.load(std::memory_order_acquire) == 0;
+            });
+            if (pending.load(std::memory_order_acquire) == 0) return;
+        }
+    }
+};
+
+struct image_job
+{
+    batch_image img;
+    std::unique_ptr<reader> r;
+    std::atomic<uint32_t> remaining{0};
+    // Statistics of the row tasks each worker ran, merged when the image is
+    // done. A worker runs one task at a time, so its slot needs no lock.
+    std::vector<image_stats> partial;
+
+    image_job(const size_t index, const std::string& path) : img{index, path, nullptr, nullptr, 0, 0, {}, {}} {}
+};
+
+uint32_t rows_per_task(const page& p, const batch_options& opt)
+{
+    if (opt.rows_per_task) return opt.rows_per_task;
+    const size_t row_bytes = std::max<size_t>(size_t(p.width) * sizeof(color_t), 1);
+    uint32_t rows = std::max<size_t>(batch_task_bytes / row_bytes, 1);
+    // Whole strips when a task spans more than one. A compressed strip is
+    // decoded as a whole, so splitting it would decode it once per task.
+    const uint32_t strip = std::min(p.rows_per_strip, p.height);
+    if (strip && p.compression != compression_t::NONE) {
+        rows = (rows + strip - 1) / strip * strip;
+    } else if (strip && rows >= strip) {
+        rows -= rows % strip;
+    }
+    return rows;
+}
+
+}
+
+size_t decode_batch(const std::vector<std::string>& paths,
+        const std::function<void(batch_image&)>& callback, const batch_options& opt)
+{
+    // Not capped by the file count: a single image still splits into row tasks.
+    const unsigned threads = opt.threads ? opt.threads : std::max(1u, std::thread::hardware_concurrency());
+    work_stealing_pool pool(threads);
+    std::atomic<size_t> decoded{0};
+
+    auto finish = [&](image_job& job) {
+        if (job.img.p) {
+            decoded.fetch_add(1, std::memory_order_relaxed);
+        }
+        for (auto& s: job.partial) {
+            job.img.stats.merge(s);
+        }
+        callback(job.img);
+    };
+
+    auto open = [&](const size_t index, const unsigned worker) {
+        auto job = std::make_shared<image_job>(index, paths[index]);
+        job->r.reset(reader::open_ptr(paths[index], opt.mode));
+        job->r->set_decode_options(opt.decode);
+        if (!job->r->is_valid() || job->r->get_page_count() == 0) {
+            finish(*job);
+            return;
+        }
+
+        const page& p = job->r->get_page(0);
+        job->img.r = job->r.get();
+        job->img.p = &p;
+        job->img.width = p.width;
+        job->img.height = p.height;
+        job->img.pixels.resize(size_t(p.width) * p.height);
+
+        const uint32_t rows = rows_per_task(p, opt);
+        const uint32_t tasks = p.height ? (p.height - 1) / rows + 1 : 0;
+        if (tasks <= 1) {
+            if (opt.stats) {
+                p.get_region_stats(0, 0, p.width, p.height, job->img.pixels.data(), 0, job->img.stats);
+            } else {
+                p.get_region(0, 0, p.width, p.height, job->img.pixels.data());
+            }
+            finish(*job);
+            return;
+        }
+
+        if (opt.stats) {
+            job->partial.resize(pool.size());
+        }
+        job->remaining.store(tasks, std::memory_order_relaxed);
+        for (uint32_t t = 0; t < tasks; t++) {
+            const uint32_t y = t * rows;
+            pool.push(worker, [job, y, rows, &finish](unsigned worker) {
+                const page& p = *job->img.p;
+                color_t* dst = job->img.pixels.data() + size_t(y) * p.width;
+                if (job->partial.empty()) {
+                    p.get_region(0, y, p.width, rows, dst);
+                } else {
+                    p.get_region_stats(0, y, p.width, rows, dst, 0, job->partial[worker]);
+                }
+                if (job->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    finish(*job);
+                }
+            });
+        }
+    };
+
+    for (size_t i = 0; i < paths.size(); i++) {
+        pool.push(i % pool.size(), [i, &open](unsigned worker) { open(i, worker); });
+    }
+    pool.run();
+
+    return decoded.load();
+}
+
+}
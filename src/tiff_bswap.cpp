@@ -0,0 +1,146 @@
+#include "tiff_bswap.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TIFF_BSWAP_X86
+#endif
+
+namespace tiff {
+
+namespace {
+
+template<typename T>
+T bswap_scalar(T v);
+template<>
+uint16_t bswap_scalar(uint16_t v) { return __builtin_bswap16(v); }
+template<>
+uint32_t bswap_scalar(uint32_t v) { return __builtin_bswap32(v); }
+template<>
+uint64_t bswap_scalar(uint64_t v) { return __builtin_bswap64(v); }
+
+template<typename T>
+void bswap_tail(uint8_t* p, const size_t count)
+{
+    for (size_t i = 0; i < count; i++, p += sizeof(T)) {
+        T v;
+        std::memcpy(&v, p, sizeof(T));
+        v = bswap_scalar(v);
+        std::memcpy(p, &v, sizeof(T));
+    }
+}
+
+#ifdef TIFF_BSWAP_X86
+
+// pshufb masks, one per element size; the upper half is the same pattern
+// shifted by 16 for the AVX2 kernel.
+alignas(32) constexpr uint8_t shuffle_mask[3][32] = {
+    { 1,  0,  3,  2,  5,  4,  7,  6,  9,  8, 11, 10, 13, 12, 15, 14,
+      1,  0,  3,  2,  5,  4,  7,  6,  9,  8, 11, 10, 13, 12, 15, 14},
+    { 3,  2,  1,  0,  7,  6,  5,  4, 11, 10,  9,  8, 15, 14, 13, 12,
+      3,  2,  1,  0,  7,  6,  5,  4, 11, 10,  9,  8, 15, 14, 13, 12},
+    { 7,  6,  5,  4,  3,  2,  1,  0, 15, 14, 13, 12, 11, 10,  9,  8,
+      7,  6,  5,  4,  3,  2,  1,  0, 15, 14, 13, 12, 11, 10,  9,  8},
+};
+
+// Both kernels return the number of bytes they handled, always a multiple of 16.
+__attribute__((target("ssse3")))
+size_t bswap_ssse3(uint8_t* p, const size_t bytes, const uint8_t* mask)
+{
+    const __m128i m = _mm_load_si128(reinterpret_cast<const __m128i*>(mask));
+    size_t i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i), _mm_shuffle_epi8(v, m));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t bswap_avx2(uint8_t* p, const size_t bytes, const uint8_t* mask)
+{
+    const __m256i m = _mm256_load_si256(reinterpret_cast<const __m256i*>(mask));
+    size_t i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i), _mm256_shuffle_epi8(v0, m));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i + 32), _mm256_shuffle_epi8(v1, m));
+    }
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i), _mm256_shuffle_epi8(v, m));
+    }
+    if (i + 16 <= bytes) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i),
+                _mm_shuffle_epi8(v, _mm256_castsi256_si128(m)));
+        i += 16;
+    }
+    return i;
+}
+
+enum class isa_t
+{
+    SCALAR,
+    SSSE3,
+    AVX2,
+};
+
+isa_t detect_isa()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return isa_t::AVX2;
+    if (__builtin_cpu_supports("ssse3")) return isa_t::SSSE3;
+    return isa_t::SCALAR;
+}
+
+#endif
+
+// Small arrays (inline tag values, a single pixel) are not worth a kernel call.
+constexpr size_t min_vector_bytes = 32;
+
+template<typename T>
+void bswap_bulk(void* data, const size_t count)
+{
+    auto p = static_cast<uint8_t*>(data);
+    size_t done = 0;
+#ifdef TIFF_BSWAP_X86
+    static const isa_t isa = detect_isa();
+    const size_t bytes = count * sizeof(T);
+    if (bytes >= min_vector_bytes) {
+        const uint8_t* mask = shuffle_mask[sizeof(T) == 2 ? 0 : sizeof(T) == 4 ? 1 : 2];
+        switch (isa) {
+        case isa_t::AVX2:
+            done = bswap_avx2(p, bytes, mask);
+            break;
+        case isa_t::SSSE3:
+            done = bswap_ssse3(p, bytes, mask);
+            break;
+        default:
+            break;
+        }
+    }
+#endif
+    bswap_tail<T>(p + done, count - done / sizeof(T));
+}
+
+}
+
+void bswap16_array(void* data, const size_t count)
+{
+    bswap_bulk<uint16_t>(data, count);
+}
+
+void bswap32_array(void* data, const size_t count)
+{
+    bswap_bulk<uint32_t>(data, count);
+}
+
+void bswap64_array(void* data, const size_t count)
+{
+    bswap_bulk<uint64_t>(data, count);
+}
+
+}
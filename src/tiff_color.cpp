@@ -0,0 +1,340 @@
+#include "tiff_color.h"
+#include "tiff_reader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define TIFF_COLOR_SSE2
+#endif
+
+namespace tiff {
+
+namespace {
+
+int16_t to_fixed(const double v)
+{
+    const double scaled = std::round(v * (1 << ycbcr_factors::shift));
+    return static_cast<int16_t>(std::clamp(scaled, -32768.0, 32767.0));
+}
+
+uint8_t clamp_u8(const int32_t v)
+{
+    return static_cast<uint8_t>(std::clamp(v, 0, 255));
+}
+
+void ycbcr_to_rgba_scalar(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, const size_t n,
+        const ycbcr_factors& f, color_t* dst)
+{
+    constexpr int32_t one = 1 << ycbcr_factors::shift;
+    constexpr int32_t round = one / 2;
+    for (size_t i = 0; i < n; i++) {
+        const int32_t l = y[i] * one + round;
+        const int32_t u = cb[i] - 128;
+        const int32_t v = cr[i] - 128;
+        dst[i].r = clamp_u8((l + v * f.cr_r) >> ycbcr_factors::shift);
+        dst[i].g = clamp_u8((l + u * f.cb_g + v * f.cr_g) >> ycbcr_factors::shift);
+        dst[i].b = clamp_u8((l + u * f.cb_b) >> ycbcr_factors::shift);
+        dst[i].a = 0;
+    }
+}
+
+void ycbcr_unpack_2x_scalar(const uint8_t* units, const size_t unit_bytes, const size_t y_offset,
+        const size_t c_offset, const size_t n_units, uint8_t* y, uint8_t* cb, uint8_t* cr)
+{
+    for (size_t i = 0; i < n_units; i++, units += unit_bytes) {
+        y[2*i] = units[y_offset];
+        y[2*i + 1] = units[y_offset + 1];
+        cb[2*i] = cb[2*i + 1] = units[c_offset];
+        cr[2*i] = cr[2*i + 1] = units[c_offset + 1];
+    }
+}
+
+// x / 255 rounded, for x up to 255 * 255
+uint8_t div255(const uint32_t x)
+{
+    const uint32_t t = x + 128;
+    return static_cast<uint8_t>((t + (t >> 8)) >> 8);
+}
+
+void cmyk_to_rgba_scalar(const uint8_t* cmyk, const size_t n, color_t* dst)
+{
+    for (size_t i = 0; i < n; i++, cmyk += 4) {
+        const uint32_t k = 255 - cmyk[3];
+        dst[i].r = div255((255 - cmyk[0]) * k);
+        dst[i].g = div255((255 - cmyk[1]) * k);
+        dst[i].b = div255((255 - cmyk[2]) * k);
+        dst[i].a = 0;
+    }
+}
+
+void premultiply_alpha_scalar(color_t* pixs, const size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        const uint32_t a = pixs[i].a;
+        pixs[i].r = div255(pixs[i].r * a);
+        pixs[i].g = div255(pixs[i].g * a);
+        pixs[i].b = div255(pixs[i].b * a);
+    }
+}
+
+void unpremultiply_alpha_scalar(color_t* pixs, const size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        const float scale = pixs[i].a ? 255.0f / pixs[i].a : 0.0f;
+        uint8_t* c[3] = {&pixs[i].r, &pixs[i].g, &pixs[i].b};
+        for (auto p: c) {
+            *p = static_cast<uint8_t>(std::min(std::lrintf(*p * scale), 255L));
+        }
+    }
+}
+
+#ifdef TIFF_COLOR_SSE2
+
+// Each channel is one or two pmaddwd over (sample, factor) pairs, so the
+// products and the sum stay in 32 bits before the shift.
+size_t ycbcr_to_rgba_sse2(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, const size_t n,
+        const ycbcr_factors& f, color_t* dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi32(1 << (ycbcr_factors::shift - 1));
+    const int16_t one = 1 << ycbcr_factors::shift;
+    const __m128i k_r = _mm_setr_epi16(one, f.cr_r, one, f.cr_r, one, f.cr_r, one, f.cr_r);
+    const __m128i k_b = _mm_setr_epi16(one, f.cb_b, one, f.cb_b, one, f.cb_b, one, f.cb_b);
+    const __m128i k_g0 = _mm_setr_epi16(one, f.cb_g, one, f.cb_g, one, f.cb_g, one, f.cb_g);
+    const __m128i k_g1 = _mm_setr_epi16(f.cr_g, 0, f.cr_g, 0, f.cr_g, 0, f.cr_g, 0);
+
+    auto channel = [&](const __m128i lo, const __m128i hi) {
+        const __m128i a = _mm_srai_epi32(_mm_add_epi32(lo, round), ycbcr_factors::shift);
+        const __m128i b = _mm_srai_epi32(_mm_add_epi32(hi, round), ycbcr_factors::shift);
+        return _mm_packs_epi32(a, b);
+    };
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(y + i)), zero);
+        const __m128i u = _mm_sub_epi16(
+                _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(cb + i)), zero), bias);
+        const __m128i v = _mm_sub_epi16(
+                _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(cr + i)), zero), bias);
+
+        const __m128i lv_lo = _mm_unpacklo_epi16(l, v), lv_hi = _mm_unpackhi_epi16(l, v);
+        const __m128i lu_lo = _mm_unpacklo_epi16(l, u), lu_hi = _mm_unpackhi_epi16(l, u);
+        const __m128i v0_lo = _mm_unpacklo_epi16(v, zero), v0_hi = _mm_unpackhi_epi16(v, zero);
+
+        const __m128i r16 = channel(_mm_madd_epi16(lv_lo, k_r), _mm_madd_epi16(lv_hi, k_r));
+        const __m128i b16 = channel(_mm_madd_epi16(lu_lo, k_b), _mm_madd_epi16(lu_hi, k_b));
+        const __m128i g16 = channel(
+                _mm_add_epi32(_mm_madd_epi16(lu_lo, k_g0), _mm_madd_epi16(v0_lo, k_g1)),
+                _mm_add_epi32(_mm_madd_epi16(lu_hi, k_g0), _mm_madd_epi16(v0_hi, k_g1)));
+
+        // r0 g0 r1 g1 ... and b0 0 b1 0 ..., then interleave as 16-bit pairs
+        const __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r16, r16), _mm_packus_epi16(g16, g16));
+        const __m128i ba = _mm_unpacklo_epi8(_mm_packus_epi16(b16, b16), zero);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 4), _mm_unpackhi_epi16(rg, ba));
+    }
+    return i;
+}
+
+// Moves the even 16-bit lanes of v to its low half and the odd ones to its
+// high half.
+__m128i split_words(const __m128i v)
+{
+    const __m128i t = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm_shuffle_epi32(t, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+// Each unit contributes one 16-bit luma pair and one 16-bit Cb/Cr pair.
+// The 4-byte 2x1 units are split apart with shuffles; other layouts gather
+// the pairs word by word. Replication then widens every chroma byte into
+// a 16-bit lane holding it twice.
+size_t ycbcr_unpack_2x_sse2(const uint8_t* units, const size_t unit_bytes, const size_t y_offset,
+        const size_t c_offset, const size_t n_units, uint8_t* y, uint8_t* cb, uint8_t* cr)
+{
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    const bool packed = unit_bytes == 4 && y_offset == 0 && c_offset == 2;
+    size_t i = 0;
+    for (; i + 8 <= n_units; i += 8, units += 8 * unit_bytes) {
+        __m128i luma, chroma;
+        if (packed) {
+            const __m128i a = split_words(_mm_loadu_si128(reinterpret_cast<const __m128i*>(units)));
+            const __m128i b = split_words(_mm_loadu_si128(reinterpret_cast<const __m128i*>(units + 16)));
+            luma = _mm_unpacklo_epi64(a, b);
+            chroma = _mm_unpackhi_epi64(a, b);
+        } else {
+            alignas(16) uint16_t lw[8], cw[8];
+            for (size_t k = 0; k < 8; k++) {
+                std::memcpy(&lw[k], units + k * unit_bytes + y_offset, 2);
+                std::memcpy(&cw[k], units + k * unit_bytes + c_offset, 2);
+            }
+            luma = _mm_load_si128(reinterpret_cast<const __m128i*>(lw));
+            chroma = _mm_load_si128(reinterpret_cast<const __m128i*>(cw));
+        }
+        const __m128i u = _mm_and_si128(chroma, low);
+        const __m128i v = _mm_srli_epi16(chroma, 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y + 2*i), luma);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(cb + 2*i), _mm_or_si128(u, _mm_slli_epi16(u, 8)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(cr + 2*i), _mm_or_si128(v, _mm_slli_epi16(v, 8)));
+    }
+    return i;
+}
+
+// Works on two pixels per 16-bit register: the inverted K of each pixel is
+// broadcast over its four lanes, so one multiply covers all three inks and
+// the K lane turns into the alpha lane, which is then cleared.
+size_t cmyk_to_rgba_sse2(const uint8_t* cmyk, const size_t n, color_t* dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8(-1);
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i rgb_mask = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+
+    auto convert = [&](const __m128i inv) {
+        __m128i k = _mm_shufflelo_epi16(inv, _MM_SHUFFLE(3, 3, 3, 3));
+        k = _mm_shufflehi_epi16(k, _MM_SHUFFLE(3, 3, 3, 3));
+        const __m128i t = _mm_add_epi16(_mm_mullo_epi16(inv, k), round);
+        return _mm_and_si128(_mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8), rgb_mask);
+    };
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(cmyk + i*4)), ones);
+        const __m128i lo = convert(_mm_unpacklo_epi8(v, zero));
+        const __m128i hi = convert(_mm_unpackhi_epi8(v, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    return i;
+}
+
+// Same broadcast as cmyk_to_rgba_sse2, with alpha instead of the inverted
+// K; the alpha lanes are put back from the source afterwards.
+size_t premultiply_alpha_sse2(color_t* pixs, const size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+
+    auto multiply = [&](const __m128i c) {
+        __m128i a = _mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3));
+        a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+        const __m128i t = _mm_add_epi16(_mm_mullo_epi16(c, a), round);
+        return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    };
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i* p = reinterpret_cast<__m128i*>(pixs + i);
+        const __m128i v = _mm_loadu_si128(p);
+        const __m128i rgb = _mm_packus_epi16(multiply(_mm_unpacklo_epi8(v, zero)), multiply(_mm_unpackhi_epi8(v, zero)));
+        _mm_storeu_si128(p, _mm_or_si128(_mm_andnot_si128(alpha_mask, rgb), _mm_and_si128(alpha_mask, v)));
+    }
+    return i;
+}
+
+// One division gives the scale of four pixels; each pixel's scale is then
+// broadcast over its own four float lanes.
+size_t unpremultiply_alpha_sse2(color_t* pixs, const size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+    const __m128 full = _mm_set1_ps(255.0f);
+
+    auto divide = [](const __m128i c, const __m128 scale) {
+        return _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(c), scale));
+    };
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i* p = reinterpret_cast<__m128i*>(pixs + i);
+        const __m128i v = _mm_loadu_si128(p);
+        const __m128 a = _mm_cvtepi32_ps(_mm_srli_epi32(v, 24));
+        const __m128 scale = _mm_and_ps(_mm_div_ps(full, a), _mm_cmpneq_ps(a, _mm_setzero_ps()));
+
+        const __m128i lo = _mm_unpacklo_epi8(v, zero);
+        const __m128i hi = _mm_unpackhi_epi8(v, zero);
+        const __m128i c0 = divide(_mm_unpacklo_epi16(lo, zero), _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(0, 0, 0, 0)));
+        const __m128i c1 = divide(_mm_unpackhi_epi16(lo, zero), _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(1, 1, 1, 1)));
+        const __m128i c2 = divide(_mm_unpacklo_epi16(hi, zero), _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(2, 2, 2, 2)));
+        const __m128i c3 = divide(_mm_unpackhi_epi16(hi, zero), _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(3, 3, 3, 3)));
+        // Both packs saturate, which clamps colors brighter than alpha to 255
+        const __m128i rgb = _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3));
+        _mm_storeu_si128(p, _mm_or_si128(_mm_andnot_si128(alpha_mask, rgb), _mm_and_si128(alpha_mask, v)));
+    }
+    return i;
+}
+
+#endif
+
+}
+
+ycbcr_factors make_ycbcr_factors(double luma_red, double luma_green, double luma_blue)
+{
+    // Fall back to the ITU-R BT.601 defaults of the tag for unusable values
+    if (!(luma_red > 0 && luma_green > 0 && luma_blue > 0)) {
+        luma_red = 0.299;
+        luma_green = 0.587;
+        luma_blue = 0.114;
+    }
+    const double cr_r = 2 - 2 * luma_red;
+    const double cb_b = 2 - 2 * luma_blue;
+    ycbcr_factors f;
+    f.cr_r = to_fixed(cr_r);
+    f.cb_g = to_fixed(-luma_blue * cb_b / luma_green);
+    f.cr_g = to_fixed(-luma_red * cr_r / luma_green);
+    f.cb_b = to_fixed(cb_b);
+    return f;
+}
+
+void ycbcr_to_rgba(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, const size_t n,
+        const ycbcr_factors& f, color_t* dst)
+{
+    size_t done = 0;
+#ifdef TIFF_COLOR_SSE2
+    done = ycbcr_to_rgba_sse2(y, cb, cr, n, f, dst);
+#endif
+    ycbcr_to_rgba_scalar(y + done, cb + done, cr + done, n - done, f, dst + done);
+}
+
+void ycbcr_unpack_2x(const uint8_t* units, const size_t unit_bytes, const size_t y_offset,
+        const size_t c_offset, const size_t n_units, uint8_t* y, uint8_t* cb, uint8_t* cr)
+{
+    size_t done = 0;
+#ifdef TIFF_COLOR_SSE2
+    done = ycbcr_unpack_2x_sse2(units, unit_bytes, y_offset, c_offset, n_units, y, cb, cr);
+#endif
+    ycbcr_unpack_2x_scalar(units + done * unit_bytes, unit_bytes, y_offset, c_offset, n_units - done,
+            y + 2*done, cb + 2*done, cr + 2*done);
+}
+
+void cmyk_to_rgba(const uint8_t* cmyk, const size_t n, color_t* dst)
+{
+    size_t done = 0;
+#ifdef TIFF_COLOR_SSE2
+    done = cmyk_to_rgba_sse2(cmyk, n, dst);
+#endif
+    cmyk_to_rgba_scalar(cmyk + done*4, n - done, dst + done);
+}
+
+void premultiply_alpha(color_t* pixs, const size_t n)
+{
+    size_t done = 0;
+#ifdef TIFF_COLOR_SSE2
+    done = premultiply_alpha_sse2(pixs, n);
+#endif
+    premultiply_alpha_scalar(pixs + done, n - done);
+}
+
+void unpremultiply_alpha(color_t* pixs, const size_t n)
+{
+    size_t done = 0;
+#ifdef TIFF_COLOR_SSE2
+    done = unpremultiply_alpha_sse2(pixs, n);
+#endif
+    unpremultiply_alpha_scalar(pixs + done, n - done);
+}
+
+}
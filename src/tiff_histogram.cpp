@@ -0,0 +1,170 @@
+#include "tiff_histogram.h"
+#include "tiff_bswap.h"
+#include "tiff_reader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace tiff {
+
+uint64_t channel_stats::count() const
+{
+    uint64_t n = 0;
+    for (auto c: histogram) {
+        n += c;
+    }
+    return n;
+}
+
+uint32_t channel_stats::min() const
+{
+    for (size_t v = 0; v < histogram.size(); v++) {
+        if (histogram[v]) return v;
+    }
+    return 0;
+}
+
+uint32_t channel_stats::max() const
+{
+    for (size_t v = histogram.size(); v > 0; v--) {
+        if (histogram[v - 1]) return v - 1;
+    }
+    return 0;
+}
+
+double channel_stats::mean() const
+{
+    uint64_t n = 0;
+    double sum = 0;
+    for (size_t v = 0; v < histogram.size(); v++) {
+        n += histogram[v];
+        sum += static_cast<double>(v) * histogram[v];
+    }
+    return n ? sum / n : 0.0;
+}
+
+void image_stats::reset(const uint8_t new_bits, const bool new_gray)
+{
+    bits = new_bits;
+    gray = new_gray;
+    pixels = 0;
+    const size_t bins = size_t(1) << bits;
+    for (unsigned c = 0; c < 4; c++) {
+        auto& h = channels[c].histogram;
+        if (gray && c > 0 && c < 3) {
+            h.clear();
+            continue;
+        }
+        h.assign(bins, 0);
+    }
+}
+
+bool image_stats::merge(const image_stats& o)
+{
+    if (o.empty()) return true;
+    if (empty()) {
+        *this = o;
+        return true;
+    }
+    if (o.bits != bits || o.gray != gray) return false;
+    pixels += o.pixels;
+    for (unsigned c = 0; c < 4; c++) {
+        auto& h = channels[c].histogram;
+        const auto& oh = o.channels[c].histogram;
+        for (size_t v = 0; v < h.size() && v < oh.size(); v++) {
+            h[v] += oh[v];
+        }
+    }
+    return true;
+}
+
+// Counting is a scatter of increments with no SIMD form on the targets we
+// build for; each channel has its own table so the increments of one pixel
+// do not depend on each other.
+void accumulate_stats(image_stats& s, const color_t* pixs, const size_t n)
+{
+    uint64_t* r = s.channels[0].histogram.data();
+    uint64_t* a = s.channels[3].histogram.data();
+    if (s.gray) {
+        for (size_t i = 0; i < n; i++) {
+            r[pixs[i].r]++;
+            a[pixs[i].a]++;
+        }
+    } else {
+        uint64_t* g = s.channels[1].histogram.data();
+        uint64_t* b = s.channels[2].histogram.data();
+        for (size_t i = 0; i < n; i++) {
+            r[pixs[i].r]++;
+            g[pixs[i].g]++;
+            b[pixs[i].b]++;
+            a[pixs[i].a]++;
+        }
+    }
+    s.pixels += n;
+}
+
+// Applies a decoder alpha conversion to the colors of v and its alpha
+// v[3], rounding as the 8-bit kernels in tiff_color.cpp do
+static void convert_alpha16(uint32_t* v, const unsigned colors, const alpha_output_t alpha)
+{
+    const uint32_t a = v[3];
+    if (alpha == alpha_output_t::PREMULTIPLIED) {
+        for (unsigned c = 0; c < colors; c++) {
+            v[c] = (v[c] * a + 0x7FFF) / 0xFFFF;
+        }
+    } else if (alpha == alpha_output_t::STRAIGHT) {
+        for (unsigned c = 0; c < colors; c++) {
+            v[c] = a ? std::min<long>(std::lrint(v[c] * (65535.0 / a)), 0xFFFF) : 0;
+        }
+    } else if (alpha == alpha_output_t::DROP) {
+        v[3] = 0;
+    }
+}
+
+void accumulate_stats16(image_stats& s, const uint8_t* samples, const size_t n, const uint16_t spp,
+        const bool swap, const bool invert, const alpha_output_t alpha)
+{
+    // A missing alpha sample counts as 0, as the decoder delivers it
+    const unsigned colors = s.gray ? 1 : std::min<unsigned>(spp, 3);
+    const unsigned alpha_sample = s.gray ? 1 : 3;
+    const bool has_alpha = spp > alpha_sample;
+    uint64_t* h[4];
+    for (unsigned c = 0; c < 4; c++) {
+        h[c] = s.channels[c].histogram.data();
+    }
+
+    constexpr size_t chunk_samples = 256;
+    uint16_t chunk[chunk_samples];
+    const size_t pixels_per_chunk = chunk_samples / spp;
+    for (size_t i = 0; i < n; i += pixels_per_chunk) {
+        const size_t count = std::min(pixels_per_chunk, n - i);
+        std::memcpy(chunk, samples + i * spp * 2, count * spp * 2);
+        if (swap) {
+            bswap16_array(chunk, count * spp);
+        }
+        const uint16_t* p = chunk;
+        for (size_t j = 0; j < count; j++, p += spp) {
+            uint32_t v[4] = {0, 0, 0, 0};
+            for (unsigned c = 0; c < colors; c++) {
+                v[c] = p[c];
+            }
+            if (s.gray && invert) {
+                v[0] = 0xFFFF - v[0];
+            }
+            if (has_alpha) {
+                v[3] = p[alpha_sample];
+                convert_alpha16(v, colors, alpha);
+            }
+            h[0][v[0]]++;
+            if (!s.gray) {
+                h[1][v[1]]++;
+                h[2][v[2]]++;
+            }
+            h[3][v[3]]++;
+        }
+    }
+    s.pixels += n;
+}
+
+}
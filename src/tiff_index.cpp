@@ -0,0 +1,112 @@
+#include "tiff_index.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <filesystem>
+#include <thread>
+
+namespace tiff {
+
+static file_summary summarize(const std::string& path)
+{
+    file_summary fs;
+    fs.path = path;
+
+    auto r = reader::open(path, open_mode_t::METADATA_ONLY);
+    if (!r.is_valid()) {
+        return fs;
+    }
+
+    fs.valid = true;
+    fs.pages.reserve(r.get_page_count());
+    for (uint32_t i = 0; i < r.get_page_count(); i++) {
+        const page& p = r.get_page(i);
+        fs.pages.push_back({
+            i,
+            p.width,
+            p.height,
+            p.sample_per_pixel,
+            {p.bit_per_samples.begin(), p.bit_per_samples.end()},
+            p.compression,
+            p.colorspace,
+            std::string(p.description),
+        });
+    }
+    return fs;
+}
+
+// Files are handed out one at a time; per-file cost varies a lot with the
+// page count, so there is no static partitioning.
+static void parallel_for(const size_t count, unsigned threads, const std::function<void(size_t)>& fn)
+{
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, std::max<size_t>(count, 1)));
+
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& t: pool) {
+        t.join();
+    }
+}
+
+void index_files(const std::vector<std::string>& paths, unsigned threads,
+        const std::function<void(const file_summary&)>& callback)
+{
+    parallel_for(paths.size(), threads, [&](size_t i) {
+        callback(summarize(paths[i]));
+    });
+}
+
+std::vector<file_summary> index_files(const std::vector<std::string>& paths, unsigned threads)
+{
+    std::vector<file_summary> ret(paths.size());
+    parallel_for(paths.size(), threads, [&](size_t i) {
+        ret[i] = summarize(paths[i]);
+    });
+    return ret;
+}
+
+std::vector<std::string> list_tiff_files(const std::string& dir, const bool recursive)
+{
+    namespace fs = std::filesystem;
+
+    auto is_tiff = [](const fs::path& p) {
+        std::string ext = p.extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+        return ext == ".tif" || ext == ".tiff";
+    };
+
+    std::vector<std::string> ret;
+    std::error_code ec;
+    if (recursive) {
+        for (auto& e: fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied, ec)) {
+            if (e.is_regular_file() && is_tiff(e.path())) ret.push_back(e.path().string());
+        }
+    } else {
+        for (auto& e: fs::directory_iterator(dir, fs::directory_options::skip_permission_denied, ec)) {
+            if (e.is_regular_file() && is_tiff(e.path())) ret.push_back(e.path().string());
+        }
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+std::vector<file_summary> index_directory(const std::string& dir, unsigned threads, const bool recursive)
+{
+    return index_files(list_tiff_files(dir, recursive), threads);
+}
+
+}
@@ -0,0 +1,220 @@
+#include "tiff_jpeg.h"
+#include "tiff_reader.h"
+
+#ifdef TIFF_READER_HAVE_JPEG
+
+#include <csetjmp>
+#include <cstdio>
+#include <vector>
+
+#include <jpeglib.h>
+
+namespace tiff {
+
+namespace {
+
+// libjpeg reports fatal errors through error_exit, which must not return;
+// jump back to the decoder call that is on the stack instead of exiting.
+struct error_manager
+{
+    jpeg_error_mgr pub;
+    std::jmp_buf jump;
+};
+
+void error_exit(j_common_ptr cinfo)
+{
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    fprintf(stderr, "JPEG: %s\n", msg);
+    std::longjmp(reinterpret_cast<error_manager*>(cinfo->err)->jump, 1);
+}
+
+// Corrupt-data warnings are common in the wild and do not stop decoding
+void output_message(j_common_ptr) {}
+
+}
+
+struct jpeg_decoder::impl
+{
+    jpeg_decompress_struct cinfo;
+    error_manager err;
+    bool active = false;
+#ifndef JCS_ALPHA_EXTENSIONS
+    std::vector<JSAMPLE> samples;
+#endif
+#ifndef TIFF_READER_JPEG_SKIP
+    std::vector<color_t> skipped;
+#endif
+
+    impl()
+    {
+        cinfo.err = jpeg_std_error(&err.pub);
+        err.pub.error_exit = error_exit;
+        err.pub.output_message = output_message;
+        jpeg_create_decompress(&cinfo);
+    }
+
+    ~impl()
+    {
+        jpeg_destroy_decompress(&cinfo);
+    }
+
+    void abort()
+    {
+        jpeg_abort_decompress(&cinfo);
+        active = false;
+    }
+};
+
+bool jpeg_supported()
+{
+    return true;
+}
+
+jpeg_decoder::jpeg_decoder() : d(std::make_unique<impl>()) {}
+
+jpeg_decoder::~jpeg_decoder() = default;
+
+bool jpeg_decoder::start(const uint8_t* tables, const size_t tables_size, const uint8_t* data, const size_t size,
+        const colorspace_t cs, const uint32_t width)
+{
+    auto& cinfo = d->cinfo;
+    if (d->active) {
+        d->abort();
+    }
+    if (setjmp(d->err.jump)) {
+        d->abort();
+        return false;
+    }
+
+    if (tables && tables_size) {
+        jpeg_mem_src(&cinfo, tables, tables_size);
+        if (jpeg_read_header(&cinfo, FALSE) != JPEG_HEADER_TABLES_ONLY) {
+            // Whatever tables it defined are kept
+            jpeg_abort_decompress(&cinfo);
+        }
+    }
+    jpeg_mem_src(&cinfo, data, size);
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        d->abort();
+        return false;
+    }
+
+    // The photometric tag, not the markers, says how the components are coded
+    int components = 3;
+    switch (cs) {
+    case colorspace_t::MINISBLACK:
+        cinfo.jpeg_color_space = JCS_GRAYSCALE;
+        components = 1;
+        break;
+    case colorspace_t::RGB:
+        cinfo.jpeg_color_space = JCS_RGB;
+        break;
+    default:
+        cinfo.jpeg_color_space = JCS_YCbCr;
+        break;
+    }
+    if (cinfo.num_components != components || cinfo.image_width != width) {
+        d->abort();
+        return false;
+    }
+#ifdef JCS_ALPHA_EXTENSIONS
+    cinfo.out_color_space = JCS_EXT_RGBA;
+#else
+    cinfo.out_color_space = JCS_RGB;
+    d->samples.resize(static_cast<size_t>(width) * 3);
+#endif
+    jpeg_start_decompress(&cinfo);
+    d->active = true;
+    return true;
+}
+
+bool jpeg_decoder::skip_rows(const uint32_t n)
+{
+    if (!d->active) return false;
+    if (n == 0) return true;
+    if (setjmp(d->err.jump)) {
+        d->abort();
+        return false;
+    }
+#ifdef TIFF_READER_JPEG_SKIP
+    return jpeg_skip_scanlines(&d->cinfo, n) == n;
+#else
+    d->skipped.resize(d->cinfo.output_width);
+    for (uint32_t i = 0; i < n; i++) {
+        if (!read_row(d->skipped.data())) return false;
+    }
+    return true;
+#endif
+}
+
+bool jpeg_decoder::read_row(color_t* row)
+{
+    if (!d->active) return false;
+    if (setjmp(d->err.jump)) {
+        d->abort();
+        return false;
+    }
+    auto& cinfo = d->cinfo;
+    const uint32_t width = cinfo.output_width;
+#ifdef JCS_ALPHA_EXTENSIONS
+    JSAMPROW p = reinterpret_cast<JSAMPROW>(row);
+    if (jpeg_read_scanlines(&cinfo, &p, 1) != 1) return false;
+    // libjpeg-turbo fills alpha with 255; opaque pixels carry 0 here
+    for (uint32_t i = 0; i < width; i++) {
+        row[i].a = 0;
+    }
+#else
+    JSAMPROW p = d->samples.data();
+    if (jpeg_read_scanlines(&cinfo, &p, 1) != 1) return false;
+    for (uint32_t i = 0; i < width; i++, p += 3) {
+        row[i] = {p[0], p[1], p[2], 0};
+    }
+#endif
+    return true;
+}
+
+void jpeg_decoder::finish()
+{
+    if (d->active) {
+        d->abort();
+    }
+}
+
+}
+
+#else
+
+namespace tiff {
+
+struct jpeg_decoder::impl {};
+
+bool jpeg_supported()
+{
+    return false;
+}
+
+jpeg_decoder::jpeg_decoder() = default;
+
+jpeg_decoder::~jpeg_decoder() = default;
+
+bool jpeg_decoder::start(const uint8_t*, const size_t, const uint8_t*, const size_t, const colorspace_t, const uint32_t)
+{
+    return false;
+}
+
+bool jpeg_decoder::skip_rows(const uint32_t)
+{
+    return false;
+}
+
+bool jpeg_decoder::read_row(color_t*)
+{
+    return false;
+}
+
+void jpeg_decoder::finish() {}
+
+}
+
+#endif
@@ -0,0 +1,56 @@
+#include "tiff_pool.h"
+
+namespace tiff {
+
+void reader_pool::returner::operator()(reader* r) const
+{
+    pool->release(r);
+}
+
+reader_pool::reader_pool(const size_t max_idle, std::pmr::memory_resource* upstream) :
+    max_idle(max_idle), upstream(upstream)
+{
+    idle.reserve(max_idle);
+}
+
+reader_pool::handle reader_pool::acquire(const std::string& path, const open_mode_t mode)
+{
+    std::unique_ptr<reader> r;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!idle.empty()) {
+            r = std::move(idle.back());
+            idle.pop_back();
+        }
+    }
+
+    if (r) {
+        r->reset(path, mode);
+    } else {
+        r.reset(reader::open_ptr(path, mode, upstream));
+    }
+    return handle(r.release(), returner{this});
+}
+
+void reader_pool::release(reader* r)
+{
+    r->close();
+    // The next user gets a reader as if it had just been opened
+    r->set_decode_options({});
+
+    std::unique_lock<std::mutex> lock(mtx);
+    if (idle.size() < max_idle) {
+        idle.emplace_back(r);
+        return;
+    }
+    lock.unlock();
+    delete r;
+}
+
+size_t reader_pool::idle_count()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return idle.size();
+}
+
+}
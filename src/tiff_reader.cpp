@@ -1,140 +1,237 @@
-#include "impls/tiff_reader.h"
-#include "impls/tiff_pal.h"
+#include "tiff_reader.h"
+#include "tiff_histogram.h"
+#include "tiff_pal.h"
 
 #include <cstdint>
+#include <cstdio>
 #include <cstddef>
 #include <cstring>
-#include <map>
 #include <algorithm>
 #include <vector>
 #include <type_traits>
+#include <mutex>
+#include <unordered_set>
 
 namespace tiff {
 
-const std::map<tag_t, std::function<bool(const reader&, const tag_entry&, page&)>> reader::tag_procs = {
-    {tag_t::IMAGE_WIDTH, tag_manager::image_width},
-    {tag_t::IMAGE_LENGTH, tag_manager::image_length},
-    {tag_t::BITS_PER_SAMPLE, tag_manager::bits_per_sample},
-    {tag_t::COMPRESSION, tag_manager::compression},
-    {tag_t::PHOTOMETRIC_INTERPRETATION, tag_manager::photometric_interpretation},
-    {tag_t::STRIP_OFFSETS, tag_manager::strip_offsets},
-    {tag_t::ROWS_PER_STRIP, tag_manager::rows_per_strip},
-    {tag_t::STRIP_BYTE_COUNTS, tag_manager::strip_byte_counts},
-    {tag_t::X_RESOLUTION, tag_manager::x_resolution},
-    {tag_t::Y_RESOLUTION, tag_manager::y_resolution},
-    {tag_t::PLANAR_CONFIGURATION, tag_manager::planar_configuration},
-    {tag_t::RESOLUTION_UNIT, tag_manager::resolution_unit},
-    {tag_t::COLOR_MAP, tag_manager::color_map},
-    {tag_t::IMAGE_DESCRIPTION, tag_manager::image_description},
-    {tag_t::SAMPLES_PER_PIXEL, tag_manager::samples_per_pixel},
-    {tag_t::DATE_TIME, tag_manager::date_time},
-    {tag_t::EXTRA_SAMPLES, tag_manager::extra_samples},
-};
+std::vector<reader::custom_tag_proc_entry> reader::custom_tag_procs;
+std::shared_mutex reader::custom_tag_procs_mtx;
 
 template<typename T>
-const std::map<T, const char*> string_map = {};
+struct enum_name
+{
+    T value;
+    const char* name;
+};
 
-template<>
-const std::map<data_t, const char*> string_map<data_t>;
+template<typename T, size_t N>
+constexpr bool is_sorted_table(const T (&table)[N])
+{
+    for (size_t i = 1; i < N; i++) {
+        if (!(table[i-1].tag < table[i].tag)) return false;
+    }
+    return true;
+}
+
+template<typename T, size_t N>
+constexpr bool is_sorted_table(const enum_name<T> (&table)[N])
+{
+    for (size_t i = 1; i < N; i++) {
+        if (!(table[i-1].value < table[i].value)) return false;
+    }
+    return true;
+}
+
+// Sorted by value, see to_string()
+template<typename T>
+struct string_table;
 
 template<>
-const std::map<endian_t, const char*> string_map<endian_t> = {
-    {endian_t::INVALID, "INVALID"},
-    {endian_t::BIG,     "BIG"},
-    {endian_t::LITTLE,  "LITTLE"}
+struct string_table<endian_t>
+{
+    static constexpr enum_name<endian_t> entries[] = {
+        {endian_t::INVALID, "INVALID"},
+        {endian_t::BIG,     "BIG"},
+        {endian_t::LITTLE,  "LITTLE"}
+    };
 };
 
 template<>
-const std::map<tag_t, const char*> string_map<tag_t> = {
-    {tag_t::NEW_SUBFILE_TYPE,           "New Subfile Type"},
-    {tag_t::IMAGE_WIDTH,                "Image Width"},
-    {tag_t::IMAGE_LENGTH,               "Image Length"},
-    {tag_t::BITS_PER_SAMPLE,            "Bits/Sample"},
-    {tag_t::COMPRESSION,                "Compression"},
-    {tag_t::PHOTOMETRIC_INTERPRETATION, "Photometric Interpretation"},
-    {tag_t::STRIP_OFFSETS,              "Strip Offsets"},
-    {tag_t::ROWS_PER_STRIP,             "Rows/Strip"},
-    {tag_t::STRIP_BYTE_COUNTS,          "Strip Byte Counts"},
-    {tag_t::X_RESOLUTION,               "X Resolution"},
-    {tag_t::Y_RESOLUTION,               "Y Resolution"},
-    {tag_t::PLANAR_CONFIGURATION,       "Planar Configuration"},
-    {tag_t::RESOLUTION_UNIT,            "Resolution Unit"},
-    {tag_t::COLOR_MAP,                  "Color Map"},
-    {tag_t::IMAGE_DESCRIPTION,          "Image Description"},
-    {tag_t::SAMPLES_PER_PIXEL,          "Samples/Pixel"},
-    {tag_t::DATE_TIME,                  "Date Time"},
-    {tag_t::EXTRA_SAMPLES,              "Extra Samples"},
+struct string_table<tag_t>
+{
+    static constexpr enum_name<tag_t> entries[] = {
+        {tag_t::NEW_SUBFILE_TYPE,           "New Subfile Type"},
+        {tag_t::IMAGE_WIDTH,                "Image Width"},
+        {tag_t::IMAGE_LENGTH,               "Image Length"},
+        {tag_t::BITS_PER_SAMPLE,            "Bits/Sample"},
+        {tag_t::COMPRESSION,                "Compression"},
+        {tag_t::PHOTOMETRIC_INTERPRETATION, "Photometric Interpretation"},
+        {tag_t::IMAGE_DESCRIPTION,          "Image Description"},
+        {tag_t::STRIP_OFFSETS,              "Strip Offsets"},
+        {tag_t::SAMPLES_PER_PIXEL,          "Samples/Pixel"},
+        {tag_t::ROWS_PER_STRIP,             "Rows/Strip"},
+        {tag_t::STRIP_BYTE_COUNTS,          "Strip Byte Counts"},
+        {tag_t::X_RESOLUTION,               "X Resolution"},
+        {tag_t::Y_RESOLUTION,               "Y Resolution"},
+        {tag_t::PLANAR_CONFIGURATION,       "Planar Configuration"},
+        {tag_t::RESOLUTION_UNIT,            "Resolution Unit"},
+        {tag_t::DATE_TIME,                  "Date Time"},
+        {tag_t::COLOR_MAP,                  "Color Map"},
+        {tag_t::INK_SET,                    "Ink Set"},
+        {tag_t::EXTRA_SAMPLES,              "Extra Samples"},
+        {tag_t::JPEG_TABLES,                "JPEG Tables"},
+        {tag_t::YCBCR_COEFFICIENTS,         "YCbCr Coefficients"},
+        {tag_t::YCBCR_SUB_SAMPLING,         "YCbCr Subsampling"},
+        {tag_t::YCBCR_POSITIONING,          "YCbCr Positioning"},
+    };
 };
 
 template<>
-const std::map<compression_t, const char*> string_map<compression_t> = {
-    {compression_t::NONE,       "None"},
-    {compression_t::CCITTRLE,   "CCITT modified Huffman RLE"},
-    {compression_t::CCITTFAX3,  "CCITT Group 3 fax encoding"},
-    {compression_t::CCITTFAX4,  "CCITT Group 4 fax encoding"},
-    {compression_t::LZW,        "LZW"},
-    {compression_t::OJPEG,      "JPEG ('old-style' JPEG)"},
-    {compression_t::JPEG,       "JPEG ('new-style' JPEG)"},
-    {compression_t::DEFLATE,    "Deflate ('Adobe-style', 'zip')"}, // zip
-    {compression_t::PACKBITS,   "PackBits"},
+struct string_table<compression_t>
+{
+    static constexpr enum_name<compression_t> entries[] = {
+        {compression_t::NONE,       "None"},
+        {compression_t::CCITTRLE,   "CCITT modified Huffman RLE"},
+        {compression_t::CCITTFAX3,  "CCITT Group 3 fax encoding"},
+        {compression_t::CCITTFAX4,  "CCITT Group 4 fax encoding"},
+        {compression_t::LZW,        "LZW"},
+        {compression_t::OJPEG,      "JPEG ('old-style' JPEG)"},
+        {compression_t::JPEG,       "JPEG ('new-style' JPEG)"},
+        {compression_t::DEFLATE,    "Deflate ('Adobe-style', 'zip')"}, // zip
+        {compression_t::PACKBITS,   "PackBits"},
+    };
 };
 
 template<>
-const std::map<colorspace_t, const char*> string_map<colorspace_t> = {
-    {colorspace_t::MINISWHITE,  "WhiteIsZero"},
-    {colorspace_t::MINISBLACK,  "BlackIsZero"},
-    {colorspace_t::RGB,         "RGB"},
-    {colorspace_t::PALETTE,     "Palette color"},
-    {colorspace_t::MASK,        "Transparency Mask"},
-    {colorspace_t::SEPARATED,   "CMYK"},
-    {colorspace_t::YCBCR,       "YCbCr"},
+struct string_table<colorspace_t>
+{
+    static constexpr enum_name<colorspace_t> entries[] = {
+        {colorspace_t::MINISWHITE,  "WhiteIsZero"},
+        {colorspace_t::MINISBLACK,  "BlackIsZero"},
+        {colorspace_t::RGB,         "RGB"},
+        {colorspace_t::PALETTE,     "Palette color"},
+        {colorspace_t::MASK,        "Transparency Mask"},
+        {colorspace_t::SEPARATED,   "CMYK"},
+        {colorspace_t::YCBCR,       "YCbCr"},
+    };
 };
 
 template<>
-const std::map<extra_data_t, const char*> string_map<extra_data_t> = {
-    {extra_data_t::UNSPECIFIED,     "Unspecified"},
-    {extra_data_t::ASSOCALPHA,      "Associated alpha (pre-multiplied aplha)"},
-    {extra_data_t::UNASSALPHA,      "Unassociated alpha"},
+struct string_table<extra_data_t>
+{
+    static constexpr enum_name<extra_data_t> entries[] = {
+        {extra_data_t::UNSPECIFIED,     "Unspecified"},
+        {extra_data_t::ASSOCALPHA,      "Associated alpha (pre-multiplied aplha)"},
+        {extra_data_t::UNASSALPHA,      "Unassociated alpha"},
+    };
 };
 
 template<>
-const std::map<planar_configuration_t, const char*> string_map<planar_configuration_t> = {
-    {planar_configuration_t::CONTIG,    "Contig"},
-    {planar_configuration_t::SEPARATE,  "Separate"},
+struct string_table<planar_configuration_t>
+{
+    static constexpr enum_name<planar_configuration_t> entries[] = {
+        {planar_configuration_t::CONTIG,    "Contig"},
+        {planar_configuration_t::SEPARATE,  "Separate"},
+    };
 };
 
 template<typename T, std::enable_if_t<std::is_enum<T>::value, std::nullptr_t>>
 const char* to_string(T e)
 {
-    if (string_map<T>.count(e)) {
-        return string_map<T>.at(e);
+    constexpr auto& entries = string_table<T>::entries;
+    static_assert(is_sorted_table(entries), "string_table must be sorted by value.");
+
+    auto it = std::lower_bound(std::begin(entries), std::end(entries), e,
+            [](const enum_name<T>& n, const T v) { return n.value < v; });
+    if (it != std::end(entries) && it->value == e) {
+        return it->name;
     }
     return "UNKNOWN";
 }
 
-int32_t page::reserve_page_id()
+double stats_t::hit_rate() const
 {
-    for (uint32_t i = 0; i < tiff_pal::PIX_BUF_COUNT; i++) {
-        if (!tiff_pal::pix_buffer_statics[i].in_use) {
-            tiff_pal::pix_buffer_statics[i].in_use = true;
-            return i;
-        }
+    const uint64_t total = buffer_hits + buffer_misses;
+    return total ? static_cast<double>(buffer_hits) / total : 0.0;
+}
+
+void stats_t::print() const
+{
+    if (!stats_enabled) {
+        printf("Statistics: disabled (build with TIFF_READER_ENABLE_STATS)\n");
+        return;
     }
-    return -1;
+    printf("Reads: %lu (%lu bytes)\n", read_calls, bytes_read);
+    printf("Pixel Buffer: %lu hits, %lu misses (%.1f%%)\n", buffer_hits, buffer_misses, hit_rate() * 100.0);
+    printf("Strip Loads: %lu (%.1f us/load)\n", strip_loads,
+            strip_loads ? strip_load_ns / 1000.0 / strip_loads : 0.0);
+    printf("Lock Waits: %lu (%.1f us total)\n", lock_count, lock_wait_ns / 1000.0);
 }
 
-void page::release_page_id(const int32_t id)
+page::page(const class reader& r) :
+    r(r), deferred(r.get_memory_resource()),
+    bit_per_samples({1}, r.get_memory_resource()), sample_per_pixel(1),
+    compression(compression_t::NONE),
+    color_palette(r.get_memory_resource()),
+    strip_offsets(r.get_memory_resource()),
+    rows_per_strip(UINT32_MAX),
+    strip_byte_counts(r.get_memory_resource()),
+    extra_sample_counts(0),
+    planar_configuration(planar_configuration_t::CONTIG),
+    ink_set(ink_set_t::CMYK),
+    ycbcr_sub_sampling{2, 2},
+    ycbcr_coefficients{{299, 1000}, {587, 1000}, {114, 1000}},
+    jpeg_tables(r.get_memory_resource()),
+    description(r.get_memory_resource()),
+    date_time(r.get_memory_resource()),
+    row_base(r.get_memory_resource()),
+    sample_lut(r.get_memory_resource())
+{}
+
+void page::invalidate()
 {
-    if (id >= static_cast<int32_t>(tiff_pal::PIX_BUF_COUNT)) return;
-    tiff_pal::pix_buffer_statics[id].in_use = false;
+    valid = false;
+    strip_offsets.clear();
+    strip_byte_counts.clear();
+    deferred.entries.clear();
+    deferred.pending.store(false, std::memory_order_release);
 }
 
-uint8_t page::calc_byte_per_pixel(const uint16_t sample_per_pixel, const std::vector<uint16_t> &bit_per_samples)
+bool page::load_deferred() const
+{
+    std::lock_guard<std::mutex> lock(*r.load_mtx);
+    if (!deferred.pending.load(std::memory_order_relaxed)) return true;
+
+    // The page is owned mutably by its reader, only the accessors are const.
+    auto& self = const_cast<page&>(*this);
+    bool ok = true;
+    for (auto& e: deferred.entries) {
+        const auto proc = reader::find_tag_proc(e.tag);
+        if (proc && !proc(r, e, self)) {
+            fprintf(stderr, "Tag %s(", to_string(e.tag));
+            fprintf(stderr, "0x%04X) process failed.\n", enum_base_cast(e.tag));
+            ok = false;
+            break;
+        }
+    }
+    deferred.entries.clear();
+    deferred.entries.shrink_to_fit();
+    // A page whose tables cannot be read decodes nothing
+    if (!ok) {
+        self.strip_offsets.clear();
+        self.strip_byte_counts.clear();
+    }
+    // After the deferred tags, which may include the color map
+    self.prepare_decode();
+    deferred.pending.store(false, std::memory_order_release);
+    return ok;
+}
+
+uint8_t page::calc_byte_per_pixel(const uint16_t sample_per_pixel, const std::pmr::vector<uint16_t> &bit_per_samples)
 {
-    printf("spp: %d\n", sample_per_pixel);
     if (bit_per_samples.size() != sample_per_pixel) {
         if (bit_per_samples.size() >= 1) {
-            return (sample_per_pixel * bit_per_samples[0]) / 8;
+            return (static_cast<uint32_t>(sample_per_pixel) * bit_per_samples[0]) / 8;
         }
     }
 
@@ -146,8 +243,12 @@ uint8_t page::calc_byte_per_pixel(const uint16_t sample_per_pixel, const std::ve
     return total_bits / 8;
 }
 
-bool page::validate_bit_per_samples(const uint16_t sample_per_pixel, std::vector<uint16_t> &bit_per_samples)
+bool page::validate_bit_per_samples(const uint16_t sample_per_pixel, std::pmr::vector<uint16_t> &bit_per_samples)
 {
+    if (sample_per_pixel == 0 || bit_per_samples.empty()) return false;
+    for (auto& b: bit_per_samples) {
+        if (b == 0 || b > 32) return false;
+    }
     while(bit_per_samples.size() < sample_per_pixel) {
         bit_per_samples.push_back(bit_per_samples[0]);
     }
@@ -163,10 +264,20 @@ void page::print_info() const
     }
     printf("\n");
     printf("Compression Scheme: %s\n", to_string(compression));
+    if (!jpeg_tables.empty()) {
+        printf("JPEG Tables: %zu bytes\n", jpeg_tables.size());
+    }
     printf("Photometric Interpretation: %s\n", to_string(colorspace));
-    printf("%ld Strips:\n", strip_offsets.size());
-    for (size_t i = 0; i < strip_offsets.size(); i++) {
-        printf("\t%ld: [%10d, %10d]\n", i, strip_offsets[i], strip_byte_counts[i]);
+    if (colorspace == colorspace_t::YCBCR) {
+        printf("YCbCr Subsampling: %u x %u\n", ycbcr_sub_sampling[0], ycbcr_sub_sampling[1]);
+    }
+    if (is_deferred() && !deferred.entries.empty()) {
+        printf("Strips: deferred\n");
+    } else {
+        printf("%ld Strips:\n", strip_offsets.size());
+        for (size_t i = 0; i < strip_offsets.size(); i++) {
+            printf("\t%ld: [%10d, %10d]\n", i, strip_offsets[i], strip_byte_counts[i]);
+        }
     }
     printf("Samples/Pixel: %d\n", sample_per_pixel);
     printf("Rows/Strip: %u\n", rows_per_strip);
@@ -179,163 +290,984 @@ void page::print_info() const
     }
 }
 
-int page::get_pixels(const uint16_t x, const uint16_t y, const size_t l, color_t *pixs) const
+stats_t page::get_stats() const
+{
+    return stats.snapshot();
+}
+
+void page::print_stats() const
+{
+    stats.snapshot().print();
+}
+
+size_t page::fread_pos(void* dest, const uint64_t pos, const size_t size) const
+{
+    stats.count_read(size);
+    return r.fread_pos(dest, pos, size);
+}
+
+void page::io_lock() const
+{
+    const auto t = stats.now();
+    r.io_lock();
+    stats.count_lock(t);
+}
+
+void page::io_unlock() const
+{
+    r.io_unlock();
+}
+
+// Staging bytes for one read. Small reads stay on the stack, larger ones
+// borrow the reader's spare block and hand it back when done.
+class scratch_buffer
 {
-    uint32_t ptr = (y*width + x) * byte_per_pixel;
-    uint16_t target_strip = 0;
-    uint32_t total_byte = 0;
-    for (auto& s: strip_byte_counts) {
-        if (total_byte + s > ptr) break;
-        total_byte += s;
-        target_strip++;
+private:
+    const reader& r;
+    reader::scratch_block* block = nullptr;
+    alignas(std::max_align_t) uint8_t local[256];
+    uint8_t* bytes = local;
+
+public:
+    scratch_buffer(const reader& r, const size_t size) : r(r)
+    {
+        if (size > sizeof(local)) {
+            block = r.take_scratch(size);
+            bytes = reinterpret_cast<uint8_t*>(block + 1);
+        }
+    }
+    scratch_buffer(const scratch_buffer&) = delete;
+    scratch_buffer& operator=(const scratch_buffer&) = delete;
+    ~scratch_buffer()
+    {
+        if (block) {
+            r.give_scratch(block);
+        }
     }
 
-    ptr -= total_byte;
+    template<class T = uint8_t>
+    T* data() const
+    {
+        return reinterpret_cast<T*>(bytes);
+    }
+};
 
-    // Specialized optimization
-    if (bit_per_samples == std::vector<uint16_t>{8, 8, 8, 8} && sample_per_pixel == 4 && colorspace == colorspace_t::RGB) {
-        r.fread_pos(pixs, strip_offsets[target_strip] + ptr, 4*l);
-        return l;
+page::pixel_layout_t page::calc_pixel_layout() const
+{
+    auto all_bits = [this](uint16_t bits) {
+        return std::all_of(bit_per_samples.begin(), bit_per_samples.end(), [bits](uint16_t b) { return b == bits; });
+    };
+    if (compression == compression_t::JPEG) {
+        const bool gray = sample_per_pixel == 1 && colorspace == colorspace_t::MINISBLACK;
+        const bool color = sample_per_pixel == 3
+            && (colorspace == colorspace_t::RGB || colorspace == colorspace_t::YCBCR);
+        return (gray || color) && all_bits(8) ? pixel_layout_t::JPEG : pixel_layout_t::GENERIC;
+    }
+    if (colorspace == colorspace_t::YCBCR) {
+        return sample_per_pixel == 3 && all_bits(8) ? pixel_layout_t::YCBCR : pixel_layout_t::GENERIC;
+    }
+    if (colorspace == colorspace_t::SEPARATED) {
+        // Four CMYK inks, the InkSet default, plus at most an alpha sample;
+        // any other ink set leaves the page undecodable
+        const bool inks = ink_set == ink_set_t::CMYK
+            && (sample_per_pixel == 4 || (sample_per_pixel == 5 && extra_sample_counts == 1));
+        return inks && (all_bits(8) || all_bits(16)) ? pixel_layout_t::CMYK : pixel_layout_t::GENERIC;
+    }
+    if (sample_per_pixel == 4 && colorspace == colorspace_t::RGB && all_bits(8)) {
+        return pixel_layout_t::RGBA8;
+    }
+    if (sample_per_pixel <= 4 && all_bits(16)) {
+        return pixel_layout_t::SAMPLES16;
+    }
+    if (sample_per_pixel == 2 && colorspace == colorspace_t::MINISBLACK && all_bits(8)) {
+        return pixel_layout_t::GRAY_ALPHA;
+    }
+    if (sample_per_pixel == 1 && bit_per_samples.size() == 1) {
+        switch (colorspace) {
+        case colorspace_t::MINISWHITE:
+        case colorspace_t::MINISBLACK:
+        case colorspace_t::PALETTE:
+        case colorspace_t::MASK:
+            if (all_bits(1) || all_bits(2) || all_bits(4) || all_bits(8)) {
+                return pixel_layout_t::INDEXED;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return pixel_layout_t::GENERIC;
+}
+
+void page::build_sample_lut()
+{
+    const uint32_t n = 1u << bit_per_samples[0];
+    const bool has_palette = colorspace == colorspace_t::PALETTE && color_palette.size() >= 3 * n;
+    sample_lut.resize(n);
+    for (uint32_t v = 0; v < n; v++) {
+        color_t& c = sample_lut[v];
+        if (has_palette) {
+            c.r = color_palette[v] >> 8;
+            c.g = color_palette[n + v] >> 8;
+            c.b = color_palette[2*n + v] >> 8;
+            continue;
+        }
+        uint8_t g = v * 255 / (n - 1);
+        if (colorspace == colorspace_t::MINISWHITE) {
+            g = 255 - g;
+        }
+        c.r = c.g = c.b = g;
     }
+}
 
-    if (sample_per_pixel == 2 && colorspace == colorspace_t::MINISBLACK) {
-        tiff_pal::info_buffer_lock();
-        for (size_t i = 0; i < l; i++) {
-            r.fread_pos(tiff_pal::info_buffer, strip_offsets[target_strip] + ptr + (i*byte_per_pixel), byte_per_pixel);
+static std::atomic<uint64_t> next_decode_id{0};
 
-            pixs[i].r = extract_memory<uint8_t>(tiff_pal::info_buffer, 0, bit_per_samples[0]);
-            pixs[i].g = pixs[i].r;
-            pixs[i].b = pixs[i].r;
-            pixs[i].a = extract_memory<uint8_t>(tiff_pal::info_buffer, bit_per_samples[0], bit_per_samples[0]);
+void page::prepare_decode()
+{
+    bit_per_pixel = 0;
+    for (auto& b: bit_per_samples) {
+        bit_per_pixel += b;
+    }
+    strip_rows = (rows_per_strip && rows_per_strip < height) ? rows_per_strip : height;
+    layout = calc_pixel_layout();
+    decode_id = next_decode_id.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    if (layout == pixel_layout_t::YCBCR) {
+        // Each data unit holds block_cols x block_rows luma samples followed
+        // by one Cb and one Cr; a row of units covers block_rows lines.
+        block_cols = ycbcr_sub_sampling[0];
+        block_rows = ycbcr_sub_sampling[1];
+        unit_bytes = block_cols * block_rows + 2;
+        row_bytes = static_cast<uint64_t>((width + block_cols - 1) / block_cols) * unit_bytes;
+        auto luma = [this](int i) {
+            const rational_t& c = ycbcr_coefficients[i];
+            return c.den ? static_cast<double>(c.num) / c.den : 0.0;
+        };
+        ycbcr = make_ycbcr_factors(luma(0), luma(1), luma(2));
+    } else {
+        block_cols = block_rows = 1;
+        unit_bytes = 0;
+        row_bytes = (static_cast<uint64_t>(width) * bit_per_pixel + 7) / 8;
+    }
+
+    // Rows are addressable up to the first one that starts past the end of
+    // the source, which also bounds the table for files claiming absurd sizes.
+    // A stream has no end to check: its strips hold the rows their byte
+    // counts cover, and the table may take no more memory than the spool.
+    const uint64_t size = r.get_source_size();
+    uint64_t rows = 0;
+    if (row_bytes && layout != pixel_layout_t::JPEG) {
+        for (size_t s = 0; s < strip_offsets.size() && rows < height; s++) {
+            const uint64_t want = std::min<uint64_t>(strip_rows, height - rows);
+            uint64_t in_source;
+            if (r.stream) {
+                const uint64_t bytes = s < strip_byte_counts.size() ? strip_byte_counts[s] : 0;
+                in_source = (bytes + row_bytes - 1) / row_bytes * block_rows;
+            } else {
+                in_source = strip_offsets[s] < size
+                    ? ((size - strip_offsets[s] - 1) / row_bytes + 1) * block_rows : 0;
+            }
+            rows += std::min(want, in_source);
+            if (in_source < want) break;
+        }
+        if (r.stream) {
+            rows = std::min<uint64_t>(rows, r.read_limit() / sizeof(row_base[0]));
+        }
+    }
+    row_base.resize(rows);
+    for (uint64_t s = 0, y = 0; y < rows; s++) {
+        for (uint32_t i = 0; i < strip_rows && y < rows; i++, y++) {
+            row_base[y] = strip_offsets[s] + (i / block_rows) * row_bytes;
         }
-        tiff_pal::info_buffer_unlock();
-        return l;
     }
 
-    // General Processing
-    tiff_pal::info_buffer_lock();
-    for (size_t i = 0; i < l; i++) {
-        r.fread_pos(tiff_pal::info_buffer, strip_offsets[target_strip] + ptr + i*byte_per_pixel, byte_per_pixel);
+    if (layout == pixel_layout_t::INDEXED) {
+        build_sample_lut();
+    } else {
+        sample_lut.clear();
+    }
+}
 
-        uint8_t* c_u8[4] = {&pixs[i].r, &pixs[i].g, &pixs[i].b, &pixs[i].a};
-        uint8_t p = 0;
-        uint8_t start_pos = 0;
-        for (auto& b: bit_per_samples) {
-            *c_u8[p++] = extract_memory<uint8_t>(tiff_pal::info_buffer, start_pos, b);
-            start_pos += b;
+bool page::locate(const uint32_t x, const uint32_t y, pixel_addr& a) const
+{
+    if (x >= width || y >= row_base.size()) return false;
+    if (layout == pixel_layout_t::YCBCR) {
+        a.pos = row_base[y] + static_cast<uint64_t>(x / block_cols) * unit_bytes;
+        a.phase = x % block_cols;
+        a.sub_row = (y % strip_rows) % block_rows;
+        return true;
+    }
+    const uint64_t bits = static_cast<uint64_t>(x) * bit_per_pixel;
+    a.pos = row_base[y] + bits / 8;
+    a.phase = bits % 8;
+    a.sub_row = 0;
+    return true;
+}
+
+// Expands packed samples, MSB first, through a lookup table. Bits divides 8,
+// so a sample never straddles a byte and whole bytes unpack without shifts
+// depending on the position.
+template<unsigned Bits>
+static void unpack_indexed(const uint8_t* src, const uint8_t bit, const size_t n, const color_t* lut, color_t* dst)
+{
+    constexpr unsigned per_byte = 8 / Bits;
+    constexpr unsigned mask = (1u << Bits) - 1;
+
+    size_t i = 0;
+    if (bit) {
+        const uint8_t b = *src++;
+        for (unsigned s = bit; s < 8 && i < n; s += Bits) {
+            dst[i++] = lut[(b >> (8 - Bits - s)) & mask];
+        }
+    }
+    for (; i + per_byte <= n; i += per_byte) {
+        const uint8_t b = *src++;
+        for (unsigned k = 0; k < per_byte; k++) {
+            dst[i + k] = lut[(b >> (8 - Bits - k * Bits)) & mask];
+        }
+    }
+    if (i < n) {
+        const uint8_t b = *src;
+        for (unsigned k = 0; i < n; k++) {
+            dst[i++] = lut[(b >> (8 - Bits - k * Bits)) & mask];
+        }
+    }
+}
+
+// Spreads a sample narrower than a byte over the full 0-255 range
+static uint8_t scale_sample(const uint64_t v, const uint16_t bits)
+{
+    if (bits == 0 || bits >= 8) return static_cast<uint8_t>(v);
+    return v * 255 / ((1u << bits) - 1);
+}
+
+// Replicates the chroma of each data unit over its pixels into planar rows,
+// then converts the rows in bulk.
+void page::decode_ycbcr(const uint8_t* src, const uint8_t phase, const uint8_t sub_row, const size_t n, color_t* dst) const
+{
+    constexpr size_t chunk = 256;
+    uint8_t ys[chunk], cbs[chunk], crs[chunk];
+    const unsigned luma = block_cols * block_rows;
+    const uint8_t* unit = src;
+    const uint8_t* line = unit + sub_row * block_cols;
+    unsigned col = phase;
+    for (size_t i = 0; i < n; i += chunk) {
+        const size_t count = std::min(chunk, n - i);
+        size_t j = 0;
+        auto gather = [&](const size_t end) {
+            for (; j < end; j++) {
+                ys[j] = line[col];
+                cbs[j] = unit[luma];
+                crs[j] = unit[luma + 1];
+                if (++col == block_cols) {
+                    col = 0;
+                    unit += unit_bytes;
+                    line += unit_bytes;
+                }
+            }
+        };
+        // Two pixel wide units are unpacked whole once a unit boundary is
+        // reached; other subsamplings and the leftover pixels go one by one.
+        if (block_cols == 2) {
+            gather(col);
+            const size_t units = (count - j) / 2;
+            ycbcr_unpack_2x(unit, unit_bytes, line - unit, luma, units, ys + j, cbs + j, crs + j);
+            unit += units * unit_bytes;
+            line += units * unit_bytes;
+            j += units * 2;
+        }
+        gather(count);
+        ycbcr_to_rgba(ys, cbs, crs, count, ycbcr, dst + i);
+    }
+}
+
+// Narrows the inks to packed 8-bit CMYK chunk by chunk and converts those,
+// unless the caller asked for the inks themselves.
+void page::decode_cmyk(const uint8_t* src, const size_t n, color_t* dst) const
+{
+    const bool native = r.get_decode_options().cmyk == cmyk_output_t::NATIVE;
+    const bool wide = bit_per_samples[0] == 16;
+    if (!wide && sample_per_pixel == 4) {
+        if (native) {
+            std::memcpy(dst, src, n * sizeof(color_t));
+        } else {
+            cmyk_to_rgba(src, n, dst);
+        }
+        return;
+    }
+
+    constexpr size_t chunk = 256;
+    uint8_t inks[chunk * 4];
+    uint8_t alpha[chunk];
+    uint16_t samples[chunk * 5];
+    const bool has_alpha = sample_per_pixel == 5;
+    for (size_t i = 0; i < n; i += chunk) {
+        const size_t count = std::min(chunk, n - i);
+        const uint8_t* s = src + i * byte_per_pixel;
+        if (wide) {
+            std::memcpy(samples, s, count * byte_per_pixel);
+            if (r.need_swap) {
+                bswap16_array(samples, count * sample_per_pixel);
+            }
+            for (size_t j = 0; j < count; j++) {
+                const uint16_t* p = samples + j * sample_per_pixel;
+                for (int k = 0; k < 4; k++) {
+                    inks[j*4 + k] = p[k] >> 8;
+                }
+                alpha[j] = has_alpha ? p[4] >> 8 : 0;
+            }
+        } else {
+            for (size_t j = 0; j < count; j++, s += sample_per_pixel) {
+                std::memcpy(inks + j*4, s, 4);
+                alpha[j] = s[4];
+            }
+        }
+
+        if (native) {
+            std::memcpy(dst + i, inks, count * sizeof(color_t));
+            continue;
+        }
+        cmyk_to_rgba(inks, count, dst + i);
+        if (has_alpha) {
+            for (size_t j = 0; j < count; j++) {
+                dst[i + j].a = alpha[j];
+            }
         }
     }
-    tiff_pal::info_buffer_unlock();
+}
+
+bool page::stores_alpha() const
+{
+    if (extra_sample_counts == 0) return false;
+    switch (layout) {
+    case pixel_layout_t::RGBA8:
+    case pixel_layout_t::GRAY_ALPHA:
+        return true;
+    case pixel_layout_t::SAMPLES16:
+        return sample_per_pixel == 4 || (sample_per_pixel == 2
+            && (colorspace == colorspace_t::MINISBLACK || colorspace == colorspace_t::MINISWHITE));
+    case pixel_layout_t::CMYK:
+        return sample_per_pixel == 5 && r.get_decode_options().cmyk == cmyk_output_t::RGBA;
+    case pixel_layout_t::GENERIC:
+        return sample_per_pixel == 4 && colorspace == colorspace_t::RGB;
+    default:
+        return false;
+    }
+}
+
+bool page::has_alpha() const
+{
+    return stores_alpha() && r.get_decode_options().alpha != alpha_output_t::DROP;
+}
+
+alpha_output_t page::alpha_conversion() const
+{
+    const alpha_output_t mode = r.get_decode_options().alpha;
+    if (mode == alpha_output_t::AS_STORED || !stores_alpha()) return alpha_output_t::AS_STORED;
+    const bool associated = extra_sample_type == extra_data_t::ASSOCALPHA;
+    if ((mode == alpha_output_t::PREMULTIPLIED && associated) || (mode == alpha_output_t::STRAIGHT && !associated)) {
+        return alpha_output_t::AS_STORED;
+    }
+    return mode;
+}
+
+void page::convert_alpha(color_t* pixs, const size_t n) const
+{
+    switch (alpha_conversion()) {
+    case alpha_output_t::PREMULTIPLIED:
+        premultiply_alpha(pixs, n);
+        break;
+    case alpha_output_t::STRAIGHT:
+        unpremultiply_alpha(pixs, n);
+        break;
+    case alpha_output_t::DROP:
+        for (size_t i = 0; i < n; i++) {
+            pixs[i].a = 0;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void page::decode_run(const uint8_t* src, const uint8_t phase, const uint8_t sub_row, const size_t n, color_t* dst) const
+{
+    decode_samples(src, phase, sub_row, n, dst);
+    convert_alpha(dst, n);
+}
+
+void page::decode_samples(const uint8_t* src, const uint8_t phase, const uint8_t sub_row, const size_t n,
+        color_t* dst) const
+{
+    switch (layout) {
+    case pixel_layout_t::RGBA8:
+        std::memcpy(dst, src, n * sizeof(color_t));
+        return;
+
+    case pixel_layout_t::SAMPLES16: {
+        // Swap in bulk chunk by chunk and keep the high byte.
+        constexpr size_t chunk_samples = 256;
+        uint16_t chunk[chunk_samples];
+        const size_t pixels_per_chunk = chunk_samples / sample_per_pixel;
+        const bool gray = sample_per_pixel <= 2
+            && (colorspace == colorspace_t::MINISBLACK || colorspace == colorspace_t::MINISWHITE);
+        const uint8_t invert = colorspace == colorspace_t::MINISWHITE ? 0xFF : 0;
+        for (size_t i = 0; i < n; i += pixels_per_chunk) {
+            const size_t count = std::min(pixels_per_chunk, n - i);
+            std::memcpy(chunk, src + i*byte_per_pixel, count*byte_per_pixel);
+            if (r.need_swap) {
+                bswap16_array(chunk, count*sample_per_pixel);
+            }
+            const uint16_t* s = chunk;
+            for (size_t j = 0; j < count; j++, s += sample_per_pixel) {
+                color_t& c = dst[i+j];
+                if (gray) {
+                    c.r = c.g = c.b = (s[0] >> 8) ^ invert;
+                    if (sample_per_pixel == 2) {
+                        c.a = s[1] >> 8;
+                    }
+                    continue;
+                }
+                uint8_t* c_u8[4] = {&c.r, &c.g, &c.b, &c.a};
+                for (uint16_t k = 0; k < sample_per_pixel; k++) {
+                    *c_u8[k] = s[k] >> 8;
+                }
+            }
+        }
+        return;
+    }
+
+    case pixel_layout_t::GRAY_ALPHA:
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t* s = src + i*byte_per_pixel;
+            dst[i].r = s[0];
+            dst[i].g = s[0];
+            dst[i].b = s[0];
+            dst[i].a = s[1];
+        }
+        return;
+
+    case pixel_layout_t::INDEXED:
+        switch (bit_per_pixel) {
+        case 1: unpack_indexed<1>(src, phase, n, sample_lut.data(), dst); return;
+        case 2: unpack_indexed<2>(src, phase, n, sample_lut.data(), dst); return;
+        case 4: unpack_indexed<4>(src, phase, n, sample_lut.data(), dst); return;
+        default: unpack_indexed<8>(src, phase, n, sample_lut.data(), dst); return;
+        }
+
+    case pixel_layout_t::YCBCR:
+        decode_ycbcr(src, phase, sub_row, n, dst);
+        return;
+
+    case pixel_layout_t::CMYK:
+        decode_cmyk(src, n, dst);
+        return;
+
+    case pixel_layout_t::JPEG:      // decoded by whole strips instead
+    case pixel_layout_t::GENERIC:
+        break;
+    }
+
+    // General Processing
+    const size_t samples = std::min<size_t>(bit_per_samples.size(), 4);
+    uint64_t pos = phase;
+    for (size_t i = 0; i < n; i++, pos += bit_per_pixel) {
+        uint8_t* c_u8[4] = {&dst[i].r, &dst[i].g, &dst[i].b, &dst[i].a};
+        uint64_t p = pos;
+        for (size_t k = 0; k < samples; k++) {
+            const uint16_t b = bit_per_samples[k];
+            *c_u8[k] = scale_sample(extract_memory<uint64_t>(src + p / 8, p % 8, b), b);
+            p += b;
+        }
+    }
+}
+
+int page::get_pixels(const uint32_t x, const uint32_t y, const size_t l, color_t *pixs) const
+{
+    ensure_loaded();
+    if (layout == pixel_layout_t::JPEG) {
+        // Compressed rows are not contiguous, so the run stops at the row end
+        if (x >= width) return 0;
+        const uint32_t n = std::min<uint64_t>(l, width - x);
+        return get_region_compressed(x, y, n, 1, pixs, n) ? n : 0;
+    }
+    pixel_addr a;
+    if (l == 0 || !locate(x, y, a)) return 0;
+    const uint64_t pos = a.pos;
+
+    const auto t = stats.now();
+
+    // Specialized optimization
+    if (layout == pixel_layout_t::RGBA8) {
+        io_lock();
+        fread_pos(pixs, pos, 4*l);
+        io_unlock();
+        convert_alpha(pixs, l);
+        stats.count_strip_load(t);
+        return l;
+    }
+
+    // One read for the whole run, then decode it in memory
+    const size_t size = span_bytes(a.phase, l);
+    scratch_buffer buf(r, size);
+    io_lock();
+    fread_pos(buf.data(), pos, size);
+    io_unlock();
+    decode_run(buf.data(), a.phase, a.sub_row, l, pixs);
+    stats.count_strip_load(t);
 
     return l;
 }
 
-color_t page::get_pixel(const uint16_t x, const uint16_t y) const
+int page::get_region(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h, color_t *pixs, size_t stride) const
+{
+    return decode_region(x, y, w, h, pixs, stride, nullptr);
+}
+
+int page::get_region_stats(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h, color_t *pixs,
+        size_t stride, image_stats& s) const
+{
+    ensure_loaded();
+    if (!prepare_stats(s)) return 0;
+    return decode_region(x, y, w, h, pixs, stride, &s);
+}
+
+bool page::prepare_stats(image_stats& s) const
 {
-    if (buffer_id == -1) return get_pixel_without_buffering(x, y);
-    uint32_t ptr = (y*width + x) * byte_per_pixel;
-    uint16_t target_strip = 0;
-    uint32_t total_byte = 0;
-    for (auto& s: strip_byte_counts) {
-        if (total_byte + s > ptr) break;
-        total_byte += s;
-        target_strip++;
+    const uint8_t bits = layout == pixel_layout_t::SAMPLES16 ? 16 : 8;
+    const bool gray = sample_per_pixel <= 2
+        && (colorspace == colorspace_t::MINISBLACK || colorspace == colorspace_t::MINISWHITE);
+    if (s.empty()) {
+        s.reset(bits, gray);
+        return true;
     }
+    return s.bits == bits && s.gray == gray;
+}
 
-    ptr -= total_byte;
+int page::decode_region(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h,
+        color_t* pixs, size_t stride, image_stats* hist) const
+{
+    ensure_loaded();
+    if (layout == pixel_layout_t::JPEG) return get_region_compressed(x, y, w, h, pixs, stride, hist);
+    pixel_addr a;
+    if (w == 0 || h == 0 || bit_per_pixel == 0 || !locate(x, y, a)) return 0;
+    if (stride == 0) stride = w;
+
+    // Reading a gap this small is cheaper than another seek and read
+    constexpr uint64_t merge_gap = 4096;
+    constexpr uint64_t max_read = 1 << 20;
+
+    const uint32_t x1 = std::min<uint64_t>(static_cast<uint64_t>(x) + w, width);
+    const size_t run = x1 - x;
+    const uint64_t run_bytes = span_bytes(a.phase, run);
+    const uint64_t column = a.pos - row_base[y];
+
+    auto row_pos = [&](uint32_t row) {
+        return row_base[row] + column;
+    };
+    const uint32_t last_row = std::min<uint64_t>(static_cast<uint64_t>(y) + h, row_base.size());
+
+    uint32_t row = y;
+    while (row < last_row) {
+        const uint64_t first = row_pos(row);
+        uint64_t end = first + run_bytes;
+        uint32_t next = row + 1;
+        for (; next < last_row; next++) {
+            const uint64_t p = row_pos(next);
+            // Lines of the same YCbCr data units share their bytes
+            if (p >= first && p + run_bytes <= end) continue;
+            if (p < end || p - end > merge_gap || p + run_bytes - first > max_read) break;
+            end = p + run_bytes;
+        }
+
+        const auto t = stats.now();
+        scratch_buffer bytes(r, end - first);
+        const uint8_t* buf = bytes.data();
+        io_lock();
+        fread_pos(bytes.data(), first, end - first);
+        io_unlock();
+        for (uint32_t i = row; i < next; i++) {
+            const uint8_t sub_row = (i % strip_rows) % block_rows;
+            const uint8_t* src = buf + (row_pos(i) - first);
+            color_t* dst = pixs + static_cast<size_t>(i - y) * stride;
+            decode_run(src, a.phase, sub_row, run, dst);
+            if (!hist) continue;
+            if (layout == pixel_layout_t::SAMPLES16) {
+                accumulate_stats16(*hist, src, run, sample_per_pixel, r.need_swap,
+                        colorspace == colorspace_t::MINISWHITE, alpha_conversion());
+            } else {
+                accumulate_stats(*hist, dst, run);
+            }
+        }
+        stats.count_strip_load(t);
+        row = next;
+    }
+
+    return row - y;
+}
+
+color_t page::get_pixel(const uint32_t x, const uint32_t y) const
+{
+    ensure_loaded();
+    if (layout == pixel_layout_t::JPEG) return get_pixel_compressed(x, y);
+    pixel_addr a;
+    if (!locate(x, y, a)) return color_t();
+    const size_t need = span_bytes(a.phase, 1);
+    if (need > pixel_cache_size) return get_pixel_without_buffering(x, y);
 
     size_t read_buffer_pos = 0;
-    tiff_pal::pix_buffer_lock();
-    if (tiff_pal::pix_buffer_statics[buffer_id].strip == target_strip
-            && tiff_pal::pix_buffer_statics[buffer_id].start <= ptr
-            && tiff_pal::pix_buffer_statics[buffer_id].start + tiff_pal::pix_buffer_statics[buffer_id].len > ptr) {
-        read_buffer_pos = ptr - tiff_pal::pix_buffer_statics[buffer_id].start;
+    io_lock();
+    if (cache.start <= a.pos && cache.start + cache.len >= a.pos + need) {
+        read_buffer_pos = a.pos - cache.start;
+        stats.count_hit();
     } else {
-        const size_t remain = strip_byte_counts[target_strip] - ptr;
-        const size_t size = tiff_pal::PIX_BUF_SIZE > remain ? remain : tiff_pal::PIX_BUF_SIZE;
-        r.fread_pos(tiff_pal::pix_buffer[buffer_id], strip_offsets[target_strip] + ptr, size);
-        tiff_pal::pix_buffer_statics[buffer_id].strip = target_strip;
-        tiff_pal::pix_buffer_statics[buffer_id].start = ptr;
-        tiff_pal::pix_buffer_statics[buffer_id].len= size;
+        // Only a miss pays for finding the strip, to bound the read by its end
+        const auto t = stats.now();
+        const uint32_t strip = y / strip_rows;
+        const uint64_t strip_end = strip_offsets[strip]
+            + (strip < strip_byte_counts.size() ? strip_byte_counts[strip] : 0);
+        const uint64_t remain = strip_end > a.pos ? strip_end - a.pos : 0;
+        const size_t size = std::clamp<uint64_t>(remain, need, pixel_cache_size);
+        fread_pos(cache.data, a.pos, size);
+        cache.start = a.pos;
+        cache.len = size;
+        stats.count_miss();
+        stats.count_strip_load(t);
     }
 
     color_t c;
-    uint8_t* c_u8[4] = {&c.r, &c.g, &c.b, &c.a};
-    uint8_t i = 0;
-    uint8_t start_pos = 0;
-    for (auto& b: bit_per_samples) {
-        *c_u8[i++] = extract_memory<uint8_t>(
-                tiff_pal::pix_buffer[buffer_id] + read_buffer_pos,
-                start_pos,
-                b);
-        start_pos += b;
-    }
-    tiff_pal::pix_buffer_unlock();
+    decode_run(cache.data + read_buffer_pos, a.phase, a.sub_row, 1, &c);
+    io_unlock();
 
     return c;
 }
 
-color_t page::get_pixel_without_buffering(const uint16_t x, const uint16_t y) const
+color_t page::get_pixel_without_buffering(const uint32_t x, const uint32_t y) const
 {
-    uint32_t ptr = (y*width + x) * byte_per_pixel;
-    uint16_t target_strip = 0;
-    uint32_t total_byte = 0;
-    for (auto& s: strip_byte_counts) {
-        if (total_byte + s > ptr) break;
-        total_byte += s;
-        target_strip++;
+    ensure_loaded();
+    if (layout == pixel_layout_t::JPEG) {
+        color_t c;
+        get_region_compressed(x, y, 1, 1, &c, 1);
+        return c;
     }
+    pixel_addr a;
+    if (!locate(x, y, a)) return color_t();
+    const size_t need = span_bytes(a.phase, 1);
 
-    ptr -= total_byte;
-
-    tiff_pal::info_buffer_lock();
-    r.fread_pos(tiff_pal::info_buffer, strip_offsets[target_strip] + ptr, byte_per_pixel);
+    scratch_buffer buf(r, need);
+    io_lock();
+    fread_pos(buf.data(), a.pos, need);
+    io_unlock();
 
     color_t c;
-    uint8_t* c_u8[4] = {&c.r, &c.g, &c.b, &c.a};
-    uint8_t i = 0;
-    uint8_t start_pos = 0;
-    for (auto& b: bit_per_samples) {
-        *c_u8[i++] = extract_memory<uint8_t>(tiff_pal::info_buffer, start_pos, b);
-        start_pos += b;
-    }
-    tiff_pal::info_buffer_unlock();
+    decode_run(buf.data(), a.phase, a.sub_row, 1, &c);
 
     return c;
 }
 
-reader::reader(const std::string& path) :
-    path(path)
+int page::get_line_chunked(const uint32_t x, const uint32_t y, const size_t n, line_sink sink, void* ctx) const
 {
-    source = tiff_pal::fopen(path.c_str(), "rb");
-    if (source <= 0) {
-        return;
+    ensure_loaded();
+    if (x >= width || n == 0) return 0;
+    const size_t count = std::min<uint64_t>(n, width - x);
+    color_t pixs[line_chunk_pixels];
+
+    if (layout == pixel_layout_t::JPEG) {
+        scratch_buffer row(r, count * sizeof(color_t));
+        if (get_region_compressed(x, y, count, 1, row.data<color_t>(), count) != 1) return 0;
+        for (size_t i = 0; i < count; i += line_chunk_pixels) {
+            sink(row.data<color_t>() + i, i, std::min(line_chunk_pixels, count - i), ctx);
+        }
+        return count;
     }
-    if (!read_header()) {
-        tiff_pal::fclose(source);
-        source = 0;
-        return;
+
+    uint8_t bytes[line_chunk_bytes];
+    size_t done = 0;
+    while (done < count) {
+        pixel_addr a;
+        if (!locate(x + done, y, a)) break;
+        size_t k = std::min(line_chunk_pixels, count - done);
+        while (k > 1 && span_bytes(a.phase, k) > sizeof(bytes)) {
+            k /= 2;
+        }
+        const size_t size = span_bytes(a.phase, k);
+        if (size > sizeof(bytes)) break;
+
+        const auto t = stats.now();
+        io_lock();
+        if (layout == pixel_layout_t::RGBA8) {
+            fread_pos(pixs, a.pos, k * sizeof(color_t));
+        } else {
+            fread_pos(bytes, a.pos, size);
+        }
+        io_unlock();
+        if (layout != pixel_layout_t::RGBA8) {
+            decode_run(bytes, a.phase, a.sub_row, k, pixs);
+        } else {
+            convert_alpha(pixs, k);
+        }
+        stats.count_strip_load(t);
+
+        sink(pixs, done, k, ctx);
+        done += k;
     }
-    if (!decode()) {
-        return;
+    return done;
+}
+
+// Decodes rows [y0, y1) of one compressed strip. Full-width rows are
+// decoded straight into dst, narrower ones through a row buffer.
+bool page::decode_strip_rows(const uint32_t strip, const uint32_t y0, const uint32_t y1,
+        const uint32_t x, const uint32_t w, color_t* dst, const size_t stride) const
+{
+    if (strip >= strip_offsets.size() || strip >= strip_byte_counts.size()) return false;
+
+    // Each thread keeps its decoder, with the strip it is in the middle of,
+    // so reading a strip row by row continues where the last call stopped
+    // instead of decoding it again from the top. It outlives the call, and
+    // possibly the reader, so it is not staged in the reader's buffers.
+    struct strip_stream
+    {
+        jpeg_decoder dec;
+        std::vector<uint8_t> data;
+        uint64_t id = 0;
+        uint32_t strip = 0;
+        uint32_t next_row = 0;
+    };
+    thread_local strip_stream s;
+
+    const auto t = stats.now();
+    const uint32_t top = strip * strip_rows;
+    uint32_t row = s.next_row;
+    if (s.id != decode_id || s.strip != strip || y0 < row) {
+        const uint64_t offset = strip_offsets[strip];
+        const uint64_t source_size = r.get_source_size();
+        s.id = 0;
+        s.data.resize(std::min<uint64_t>({strip_byte_counts[strip], offset < source_size ? source_size - offset : 0,
+                r.read_limit()}));
+        if (s.data.empty()) return false;
+        io_lock();
+        fread_pos(s.data.data(), offset, s.data.size());
+        io_unlock();
+        if (!s.dec.start(jpeg_tables.data(), jpeg_tables.size(), s.data.data(), s.data.size(), colorspace, width)) {
+            return false;
+        }
+        s.id = decode_id;
+        s.strip = strip;
+        row = top;
+    }
+
+    bool ok = s.dec.skip_rows(y0 - row);
+    if (x == 0 && w == width) {
+        for (uint32_t y = y0; ok && y < y1; y++) {
+            ok = s.dec.read_row(dst + static_cast<size_t>(y - y0) * stride);
+        }
+    } else {
+        // Sized only now that the stream has confirmed the width
+        scratch_buffer buf(r, width * sizeof(color_t));
+        for (uint32_t y = y0; ok && y < y1; y++) {
+            ok = s.dec.read_row(buf.data<color_t>());
+            if (ok) {
+                std::memcpy(dst + static_cast<size_t>(y - y0) * stride, buf.data<color_t>() + x, w * sizeof(color_t));
+            }
+        }
+    }
+    s.next_row = y1;
+    if (!ok || y1 == std::min(top + strip_rows, height)) {
+        s.dec.finish();
+        s.id = 0;
+        // Only a strip in the middle of being read keeps its bytes, so idle
+        // pool threads do not each hold the last strip they decoded
+        std::vector<uint8_t>().swap(s.data);
+    }
+    stats.count_strip_load(t);
+    return ok;
+}
+
+int page::get_region_compressed(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h,
+        color_t* pixs, size_t stride, image_stats* hist) const
+{
+    if (w == 0 || h == 0 || x >= width || y >= height) return 0;
+    if (stride == 0) stride = w;
+
+    const uint32_t run = std::min<uint64_t>(static_cast<uint64_t>(x) + w, width) - x;
+    const uint32_t last_row = std::min<uint64_t>(static_cast<uint64_t>(y) + h, height);
+    uint32_t row = y;
+    while (row < last_row) {
+        const uint32_t strip = row / strip_rows;
+        const uint32_t end = std::min<uint64_t>(static_cast<uint64_t>(strip + 1) * strip_rows, last_row);
+        color_t* dst = pixs + static_cast<size_t>(row - y) * stride;
+        if (!decode_strip_rows(strip, row, end, x, run, dst, stride)) break;
+        for (uint32_t i = row; hist && i < end; i++, dst += stride) {
+            accumulate_stats(*hist, dst, run);
+        }
+        row = end;
+    }
+    return row - y;
+}
+
+color_t page::get_pixel_compressed(const uint32_t x, const uint32_t y) const
+{
+    if (x >= width || y >= height) return color_t();
+
+    // Each thread keeps the last band of rows it decoded, so no lock is
+    // held while decoding and threads walking different strips do not
+    // evict each other. A band is the whole strip when it fits the cache,
+    // otherwise as many rows as do; bands of one strip are read in order,
+    // so walking it continues the decode instead of restarting it.
+    struct band_cache
+    {
+        uint64_t id = 0;
+        uint32_t top = 0;
+        uint32_t rows = 0;
+        std::vector<color_t> pixels;
+    };
+    thread_local band_cache last;
+    // Bounds what every decoding thread holds on to, 1 MiB each
+    constexpr uint64_t max_cached_pixels = 1 << 18;
+
+    if (last.id != decode_id || y < last.top || y - last.top >= last.rows) {
+        const uint32_t strip = y / strip_rows;
+        const uint32_t top = strip * strip_rows;
+        const uint32_t end = std::min(top + strip_rows, height);
+        const uint32_t band_rows = std::min<uint64_t>(strip_rows, max_cached_pixels / width);
+        if (band_rows == 0) {
+            color_t c;
+            decode_strip_rows(strip, y, y + 1, x, 1, &c, 1);
+            return c;
+        }
+        const uint32_t band_top = top + (y - top) / band_rows * band_rows;
+        const uint32_t rows = std::min(band_rows, end - band_top);
+        last.id = 0;
+        last.pixels.assign(static_cast<size_t>(width) * rows, color_t());
+        if (!decode_strip_rows(strip, band_top, band_top + rows, 0, width, last.pixels.data(), width)) {
+            return color_t();
+        }
+        last.id = decode_id;
+        last.top = band_top;
+        last.rows = rows;
+        stats.count_miss();
+    } else {
+        stats.count_hit();
     }
+    return last.pixels[static_cast<size_t>(y - last.top) * width + x];
+}
+
+reader::reader(const std::string& path, const open_mode_t mode, std::pmr::memory_resource* upstream,
+        const std::string& index_path) :
+    path(path), index_path(index_path), mode(mode), source(0),
+    io_mtx(std::make_unique<std::mutex>()), load_mtx(std::make_unique<std::mutex>()),
+    arena(std::make_unique<arena_resource>(
+                arena_initial_size, upstream ? upstream : std::pmr::get_default_resource())),
+    ifds(arena.get()), pages(arena.get())
+{
+    load();
+}
+
+reader::reader(const void* data, const size_t size, const open_mode_t mode, std::pmr::memory_resource* upstream) :
+    mode(mode), source(0), memory(static_cast<const uint8_t*>(data)), source_size(size),
+    io_mtx(std::make_unique<std::mutex>()), load_mtx(std::make_unique<std::mutex>()),
+    arena(std::make_unique<arena_resource>(
+                arena_initial_size, upstream ? upstream : std::pmr::get_default_resource())),
+    ifds(arena.get()), pages(arena.get())
+{
+    load();
 }
 
 reader::~reader()
 {
-    if (is_valid()) {
-        tiff_pal::fclose(source);
+    close();
+    free_scratch(spare_scratch.load());
+}
+
+reader::scratch_block* reader::take_scratch(const size_t size) const
+{
+    scratch_block* b = spare_scratch.exchange(nullptr, std::memory_order_acquire);
+    if (b && b->capacity >= size) return b;
+    free_scratch(b);
+    void* p = arena->upstream_resource()->allocate(sizeof(scratch_block) + size, alignof(scratch_block));
+    return new (p) scratch_block{size};
+}
+
+// Keeps b as the spare, freeing the block it replaces
+void reader::give_scratch(scratch_block* b) const
+{
+    free_scratch(spare_scratch.exchange(b, std::memory_order_acq_rel));
+}
+
+void reader::free_scratch(scratch_block* b) const
+{
+    if (!b) return;
+    arena->upstream_resource()->deallocate(b, sizeof(scratch_block) + b->capacity, alignof(scratch_block));
+}
+
+bool reader::load()
+{
+    if (memory) {
+        source = reinterpret_cast<intptr_t>(memory);
+    } else if (stream) {
+        source = reinterpret_cast<intptr_t>(stream.get());
+    } else {
+        source = tiff_pal::fopen(path.c_str(), "rb");
+        if (source <= 0) {
+            source = 0;
+            return false;
+        }
+        tiff_pal::fseek(source, 0, SEEK_END);
+        const int64_t end = tiff_pal::ftell(source);
+        source_size = end > 0 ? end : 0;
+        file_pos = UINT64_MAX;
+    }
+    if (!read_header()) {
+        close();
+        return false;
+    }
+    return decode();
+}
+
+void reader::close()
+{
+    if (source) {
+        if (!memory && !stream) {
+            tiff_pal::fclose(source);
+        }
+        source = 0;
     }
 }
 
-reader reader::open(const std::string& path)
+bool reader::reset(const std::string& new_path, const open_mode_t new_mode)
+{
+    close();
+
+    // Drop every container before the arena is rewound; the empty
+    // replacements do not allocate.
+    std::pmr::vector<page>(arena.get()).swap(pages);
+    std::pmr::vector<ifd>(arena.get()).swap(ifds);
+    arena->rewind();
+
+    path = new_path;
+    index_path.clear();
+    mode = new_mode;
+    memory = nullptr;
+    stream.reset();
+    source_size = 0;
+    decoded = false;
+    stats.reset();
+    return load();
+}
+
+reader reader::open(const std::string& path, const open_mode_t mode, std::pmr::memory_resource* upstream)
 {
-    return reader(path);
+    return reader(path, mode, upstream);
 }
 
-reader *reader::open_ptr(const std::string& path)
+reader *reader::open_ptr(const std::string& path, const open_mode_t mode, std::pmr::memory_resource* upstream)
 {
-    return new reader(path);
+    return new reader(path, mode, upstream);
+}
+
+reader reader::open_memory(const void* data, const size_t size, const open_mode_t mode, std::pmr::memory_resource* upstream)
+{
+    return reader(data, size, mode, upstream);
 }
 
 bool reader::is_valid() const
@@ -345,10 +1277,12 @@ bool reader::is_valid() const
 
 bool reader::read_header()
 {
-    tiff_pal::info_buffer_lock();
-    fread_pos(tiff_pal::info_buffer, 0, 8);
+    uint8_t buf[8];
+    io_lock();
+    fread_pos(buf, 0, sizeof(buf));
+    io_unlock();
     {
-        buffer_reader r(tiff_pal::info_buffer);
+        buffer_reader r(buf);
         r.read_array(h.order);
         endian_t t = check_endian_type(h.order);
         if (t == endian_t::INVALID) return false;
@@ -358,7 +1292,6 @@ bool reader::read_header()
         r.read(h.version);
         r.read(h.offset);
     }
-    tiff_pal::info_buffer_unlock();
 
     if (h.version != 42) return false;
     return true;
@@ -375,11 +1308,41 @@ endian_t reader::check_endian_type(const char* const s)
     }
 }
 
-size_t reader::fread_pos(void* dest, const size_t pos, const size_t size) const
+void reader::io_lock() const
+{
+    const auto t = stats.now();
+    io_mtx->lock();
+    stats.count_lock(t);
+}
+
+void reader::io_unlock() const
 {
-    tiff_pal::fseek(source, pos, SEEK_SET);
-    tiff_pal::fread(reinterpret_cast<uint8_t*>(dest), size, 1, source);
-    return size;
+    io_mtx->unlock();
+}
+
+size_t reader::fread_pos(void* dest, const uint64_t pos, const size_t size) const
+{
+    stats.count_read(size);
+    size_t got = 0;
+    if (memory) {
+        if (pos < source_size) {
+            got = std::min<uint64_t>(size, source_size - pos);
+            std::memcpy(dest, memory + pos, got);
+        }
+    } else if (stream) {
+        got = read_stream(dest, pos, size);
+    } else {
+        if (pos != file_pos) {
+            tiff_pal::fseek(source, static_cast<int64_t>(pos), SEEK_SET);
+        }
+        got = tiff_pal::fread(dest, 1, size, source);
+        file_pos = got == size ? pos + got : UINT64_MAX;
+    }
+    // Bytes past the end of the source read as zero
+    if (got < size) {
+        std::memset(static_cast<uint8_t*>(dest) + got, 0, size - got);
+    }
+    return got;
 }
 
 bool reader::is_big_endian() const
@@ -392,60 +1355,221 @@ bool reader::is_little_endian() const
     return endi == endian_t::LITTLE;
 }
 
-void reader::fetch_ifds(std::vector<ifd> &ifds) const
+bool reader::fetch_ifds(std::pmr::vector<ifd> &ifds) const
 {
-
-    tiff_pal::info_buffer_lock();
-
-    // TODO: In rare cases, there may be more multiple IFD.
-    ifds.resize(1);
-    buffer_reader r(tiff_pal::info_buffer, need_swap);
-    fread_pos(tiff_pal::info_buffer, h.offset, sizeof(ifd::entry_count));
-    r.read(ifds[0].entry_count);
-    ifds[0].entries.resize(ifds[0].entry_count);
-
-    size_t e_size = 12;
-    for (int i = 0; i < ifds[0].entry_count; i++) {
-        fread_pos(tiff_pal::info_buffer, h.offset + 2 + i * e_size, e_size);
-        r.seek_top();
-        r.read(ifds[0].entries[i].tag);
-        r.read(ifds[0].entries[i].field_type);
-        r.read(ifds[0].entries[i].field_count);
-        r.read(ifds[0].entries[i].data_field);
+    ifds.clear();
+    constexpr size_t e_size = 12;
+
+    // Follows the chain of IFDs to its end. A link that leaves the file or
+    // revisits an IFD ends the walk; only a bad first IFD is an error. The
+    // visited set lives on the arena, so a reused reader allocates nothing.
+    std::pmr::unordered_set<uint32_t> visited(get_memory_resource());
+    uint32_t offset = h.offset;
+    io_lock();
+    while (offset != 0 && visited.insert(offset).second) {
+        if (static_cast<uint64_t>(offset) + sizeof(ifd::entry_count) > source_size) break;
+        uint8_t count_buf[sizeof(ifd::entry_count)];
+        fread_pos(count_buf, offset, sizeof(count_buf));
+        uint16_t entry_count;
+        buffer_reader(count_buf, need_swap).read(entry_count);
+        // The entries and the link to the next IFD are read in one go; a
+        // link past the end of the file reads as 0.
+        const size_t size = static_cast<size_t>(entry_count) * e_size;
+        if (offset + 2 + static_cast<uint64_t>(size) > source_size) break;
+        scratch_buffer bytes(*this, size + sizeof(ifd::next_ifd));
+        const uint8_t* buf = bytes.data();
+        fread_pos(bytes.data(), offset + 2, size + sizeof(ifd::next_ifd));
+
+        ifds.push_back({entry_count, std::pmr::vector<tag_entry>(entry_count, get_memory_resource()), 0});
+        ifd& d = ifds.back();
+        buffer_reader r(buf, need_swap);
+        for (auto& e: d.entries) {
+            r.read(e.tag);
+            r.read(e.field_type);
+            r.read(e.field_count);
+            r.read(e.data_field);
+        }
+        r.read(d.next_ifd);
+        offset = d.next_ifd;
+        // The next IFD of a stream usually follows this page's strips
+        if (stream) break;
     }
-    fread_pos(tiff_pal::info_buffer, h.offset, sizeof(ifd::next_ifd));
-    r.read(ifds[0].next_ifd);
-
-    tiff_pal::info_buffer_unlock();
+    io_unlock();
+    return !ifds.empty();
 }
 
-bool reader::read_entry_tags(const std::vector<ifd> &ifds, std::vector<page> &pages)
+bool reader::read_entry_tags(const std::pmr::vector<ifd> &ifds, std::pmr::vector<page> &pages)
 {
+    // A page this reader cannot decode fails the open when it is the first
+    // one; later pages, often thumbnails or masks, are only marked invalid.
     uint32_t page_index = 0;
     for (auto& ifd: ifds) {
+        page& p = pages[page_index];
+        bool ok = true;
         for(auto& e: ifd.entries) {
-            if (tag_procs.count(e.tag)) {
-                if(!tag_procs.at(e.tag)(*this, e, pages[page_index])) {
-                    printf("Tag %s(", to_string(e.tag));
-                    printf("0x%04X) process failed.\n", enum_base_cast(e.tag));
-                    return false;
-                }
+            if (mode == open_mode_t::METADATA_ONLY && is_deferrable_tag(e)) {
+                p.deferred.entries.push_back(e);
+                p.deferred.pending.store(true, std::memory_order_release);
+            } else if (const auto proc = find_tag_proc(e.tag)) {
+                ok = proc(*this, e, p);
+            } else if (const auto custom = find_custom_tag_proc(e.tag)) {
+                ok = custom(*this, e, p);
             } else {
                 // printf("Tags id: 0x%04X is not implemented.\n", enum_base_cast(e.tag));
             }
+            if (!ok) {
+                fprintf(stderr, "Tag %s(", to_string(e.tag));
+                fprintf(stderr, "0x%04X) process failed.\n", enum_base_cast(e.tag));
+                break;
+            }
+        }
+        if (ok && !p.validate()) {
+            fprintf(stderr, "Invalid sample layout.\n");
+            ok = false;
+        }
+        if (!ok) {
+            if (page_index == 0) return false;
+            fprintf(stderr, "Page %u cannot be decoded.\n", page_index);
+            p.invalidate();
         }
         page_index++;
     }
+    return true;
+}
 
-    for (auto& page: pages) {
-        page.validate();
+reader::tag_proc_t reader::find_tag_proc(tag_t tag)
+{
+    // Sorted by tag value so the lookup is a binary search over a constant table.
+    static constexpr tag_proc_entry table[] = {
+        {tag_t::IMAGE_WIDTH,                tag_manager::image_width},
+        {tag_t::IMAGE_LENGTH,               tag_manager::image_length},
+        {tag_t::BITS_PER_SAMPLE,            tag_manager::bits_per_sample},
+        {tag_t::COMPRESSION,                tag_manager::compression},
+        {tag_t::PHOTOMETRIC_INTERPRETATION, tag_manager::photometric_interpretation},
+        {tag_t::IMAGE_DESCRIPTION,          tag_manager::image_description},
+        {tag_t::STRIP_OFFSETS,              tag_manager::strip_offsets},
+        {tag_t::SAMPLES_PER_PIXEL,          tag_manager::samples_per_pixel},
+        {tag_t::ROWS_PER_STRIP,             tag_manager::rows_per_strip},
+        {tag_t::STRIP_BYTE_COUNTS,          tag_manager::strip_byte_counts},
+        {tag_t::X_RESOLUTION,               tag_manager::x_resolution},
+        {tag_t::Y_RESOLUTION,               tag_manager::y_resolution},
+        {tag_t::PLANAR_CONFIGURATION,       tag_manager::planar_configuration},
+        {tag_t::RESOLUTION_UNIT,            tag_manager::resolution_unit},
+        {tag_t::DATE_TIME,                  tag_manager::date_time},
+        {tag_t::COLOR_MAP,                  tag_manager::color_map},
+        {tag_t::INK_SET,                    tag_manager::ink_set},
+        {tag_t::EXTRA_SAMPLES,              tag_manager::extra_samples},
+        {tag_t::JPEG_TABLES,                tag_manager::jpeg_tables},
+        {tag_t::YCBCR_COEFFICIENTS,         tag_manager::ycbcr_coefficients},
+        {tag_t::YCBCR_SUB_SAMPLING,         tag_manager::ycbcr_sub_sampling},
+    };
+    static_assert(is_sorted_table(table), "tag proc table must be sorted by tag.");
+
+    const auto begin = std::begin(table);
+    const auto end = std::end(table);
+    const auto it = std::lower_bound(begin, end, tag,
+            [](const tag_proc_entry& p, const tag_t t) { return p.tag < t; });
+    if (it != end && it->tag == tag) {
+        return it->proc;
     }
-    return true;
+    return nullptr;
+}
+
+bool reader::is_deferrable_tag(const tag_entry& e)
+{
+    // Only tags whose data lives out of line cost extra reads.
+    switch (e.tag) {
+    case tag_t::STRIP_OFFSETS:
+    case tag_t::STRIP_BYTE_COUNTS:
+        return e.field_count >= 2;
+    case tag_t::COLOR_MAP:
+    case tag_t::JPEG_TABLES:
+        return true;
+    default:
+        return false;
+    }
+}
+
+reader::custom_tag_proc_t reader::find_custom_tag_proc(tag_t tag)
+{
+    std::shared_lock<std::shared_mutex> lock(custom_tag_procs_mtx);
+    if (custom_tag_procs.empty()) return nullptr;
+    const auto it = std::lower_bound(custom_tag_procs.begin(), custom_tag_procs.end(), tag,
+            [](const custom_tag_proc_entry& p, const tag_t t) { return p.tag < t; });
+    if (it != custom_tag_procs.end() && it->tag == tag) {
+        return it->proc;
+    }
+    return nullptr;
+}
+
+void reader::register_tag_proc(tag_t tag, custom_tag_proc_t proc)
+{
+    std::lock_guard<std::shared_mutex> lock(custom_tag_procs_mtx);
+    const auto it = std::lower_bound(custom_tag_procs.begin(), custom_tag_procs.end(), tag,
+            [](const custom_tag_proc_entry& p, const tag_t t) { return p.tag < t; });
+    if (it != custom_tag_procs.end() && it->tag == tag) {
+        it->proc = std::move(proc);
+    } else {
+        custom_tag_procs.insert(it, {tag, std::move(proc)});
+    }
+}
+
+void reader::unregister_tag_proc(tag_t tag)
+{
+    std::lock_guard<std::shared_mutex> lock(custom_tag_procs_mtx);
+    const auto it = std::lower_bound(custom_tag_procs.begin(), custom_tag_procs.end(), tag,
+            [](const custom_tag_proc_entry& p, const tag_t t) { return p.tag < t; });
+    if (it != custom_tag_procs.end() && it->tag == tag) {
+        custom_tag_procs.erase(it);
+    }
+}
+
+uint32_t reader::read_tag_scalar(const tag_entry& e) const
+{
+    return tag_manager::read_scalar_generic(*this, e);
+}
+
+size_t reader::read_tag_bytes(const tag_entry& e, void* dest, const size_t size) const
+{
+    size_t type_size = 1;
+    switch (e.field_type) {
+    case data_t::SHORT:
+    case data_t::SSHORT:
+        type_size = 2;
+        break;
+    case data_t::LONG:
+    case data_t::SLONG:
+    case data_t::FLOAT:
+        type_size = 4;
+        break;
+    case data_t::RATIONAL:
+    case data_t::SRATIONAL:
+    case data_t::DOUBLE:
+        type_size = 8;
+        break;
+    default:
+        break;
+    }
+    const size_t len = std::min(size, static_cast<size_t>(e.field_count) * type_size);
+    if (static_cast<size_t>(e.field_count) * type_size <= sizeof(e.data_field)) {
+        // data_field was swapped as a whole, so swap it back to file order
+        const uint32_t raw = need_swap ? buffer_reader::bswap(e.data_field) : e.data_field;
+        std::memcpy(dest, &raw, len);
+        return len;
+    }
+    return fread_pos(dest, tag_manager::read_scalar<uint32_t>(*this, e), len);
 }
 
 bool reader::decode()
 {
-    fetch_ifds(ifds);
+    if (!index_path.empty() && load_index()) {
+        decoded = true;
+        return true;
+    }
+    if (!fetch_ifds(ifds)) {
+        fprintf(stderr, "IFD lies outside the file.\n");
+        return false;
+    }
     for (size_t i = 0; i < ifds.size(); i++) {
         pages.push_back(page(*this));
     }
@@ -454,7 +1578,14 @@ bool reader::decode()
         return false;
     }
 
+    if (stream && !end_stream_parse()) {
+        return false;
+    }
+
     decoded = true;
+    if (!index_path.empty()) {
+        save_index(index_path);
+    }
     return true;
 }
 
@@ -468,6 +1599,26 @@ uint32_t reader::get_page_count() const
     return pages.size();
 }
 
+std::pmr::memory_resource* reader::get_memory_resource() const
+{
+    return arena.get();
+}
+
+uint64_t reader::get_source_size() const
+{
+    return source_size;
+}
+
+void reader::set_decode_options(const decode_options& opt)
+{
+    options = opt;
+}
+
+const decode_options& reader::get_decode_options() const
+{
+    return options;
+}
+
 void reader::print_header() const
 {
     printf("order: %.2s\n", h.order);
@@ -475,6 +1626,24 @@ void reader::print_header() const
     printf("offset: %u\n", h.offset);
 }
 
+stats_t reader::get_stats() const
+{
+    return stats.snapshot();
+}
+
+void reader::print_stats() const
+{
+    stats.snapshot().print();
+}
+
+void reader::reset_stats()
+{
+    stats.reset();
+    for (auto& p: pages) {
+        p.stats.reset();
+    }
+}
+
 bool reader::tag_manager::image_width(const reader &r, const tag_entry &e, page& p)
 {
     p.width = read_scalar_generic(r, e);
@@ -487,13 +1656,13 @@ bool reader::tag_manager::image_length(const reader &r, const tag_entry &e, page
 }
 bool reader::tag_manager::bits_per_sample(const reader &r, const tag_entry &e, page& p)
 {
-    if (e.data_field <= 0) return false;
+    if (e.data_field <= 0 || e.field_count == 0 || !fits_in_source(r, e, sizeof(uint16_t))) return false;
     if (e.field_count * sizeof(uint16_t) > sizeof(uint32_t)) {
         p.bit_per_samples.resize(e.field_count);
         uint32_t ptr = read_scalar<uint32_t>(r, e);
-        tiff_pal::info_buffer_lock();
-        r.fread_array_buffering(p.bit_per_samples, tiff_pal::info_buffer, tiff_pal::INFO_BUF_SIZE, ptr);
-        tiff_pal::info_buffer_unlock();
+        r.io_lock();
+        r.fread_array(p.bit_per_samples, ptr);
+        r.io_unlock();
     } else {
         p.bit_per_samples.resize(1);
         p.bit_per_samples[0] = read_scalar<uint16_t>(r, e);
@@ -503,8 +1672,8 @@ bool reader::tag_manager::bits_per_sample(const reader &r, const tag_entry &e, p
 bool reader::tag_manager::compression(const reader &r, const tag_entry &e, page& p)
 {
     auto c = static_cast<compression_t>(read_scalar<uint16_t>(r, e));
-    if (c != compression_t::NONE) {
-        printf("Compressed tiff is not supported.\n");
+    if (c != compression_t::NONE && !(c == compression_t::JPEG && jpeg_supported())) {
+        fprintf(stderr, "Compressed tiff is not supported.\n");
         return false;
     }
     p.compression = c;
@@ -519,21 +1688,23 @@ bool reader::tag_manager::photometric_interpretation(const reader &r, const tag_
     case colorspace_t::RGB:
     case colorspace_t::PALETTE:
     case colorspace_t::MASK:
+    case colorspace_t::SEPARATED:
+    case colorspace_t::YCBCR:
         return true;
     default:
-        printf("Specified color space is not available.\n");
+        fprintf(stderr, "Specified color space is not available.\n");
         return false;
     }
 }
 bool reader::tag_manager::strip_offsets(const reader &r, const tag_entry &e, page& p)
 {
-    if (e.data_field <= 0) return false;
+    if (e.data_field <= 0 || e.field_count == 0 || !fits_in_source(r, e, sizeof(uint32_t))) return false;
     p.strip_offsets.resize(e.field_count);
     if (e.field_count >= 2) {
         uint32_t ptr = read_scalar<uint32_t>(r, e);
-        tiff_pal::info_buffer_lock();
-        r.fread_array_buffering(p.strip_offsets, tiff_pal::info_buffer, tiff_pal::INFO_BUF_SIZE, ptr);
-        tiff_pal::info_buffer_unlock();
+        r.io_lock();
+        r.fread_array(p.strip_offsets, ptr);
+        r.io_unlock();
     } else {
         p.strip_offsets[0] = read_scalar<uint32_t>(r, e);
     }
@@ -546,13 +1717,13 @@ bool reader::tag_manager::rows_per_strip(const reader &r, const tag_entry &e, pa
 }
 bool reader::tag_manager::strip_byte_counts(const reader &r, const tag_entry &e, page& p)
 {
-    if (e.data_field <= 0) return false;
+    if (e.data_field <= 0 || e.field_count == 0 || !fits_in_source(r, e, sizeof(uint32_t))) return false;
     p.strip_byte_counts.resize(e.field_count);
     if (e.field_count >= 2) {
         uint32_t ptr = read_scalar<uint32_t>(r, e);
-        tiff_pal::info_buffer_lock();
-        r.fread_array_buffering(p.strip_byte_counts, tiff_pal::info_buffer, tiff_pal::INFO_BUF_SIZE, ptr);
-        tiff_pal::info_buffer_unlock();
+        r.io_lock();
+        r.fread_array(p.strip_byte_counts, ptr);
+        r.io_unlock();
     } else {
         p.strip_byte_counts[0] = read_scalar<uint32_t>(r, e);
     }
@@ -584,31 +1755,25 @@ bool reader::tag_manager::color_map(const reader &r, const tag_entry &e, page& p
     if (e.field_count <= 0) return true;
 
     uint32_t ptr = read_scalar<uint32_t>(r, e);
-    if (ptr == 0) return false;
+    if (ptr == 0 || !fits_in_source(r, e, sizeof(uint16_t))) return false;
 
     p.color_palette.resize(e.field_count);
-    tiff_pal::info_buffer_lock();
-    r.fread_array_buffering(p.color_palette, tiff_pal::info_buffer, tiff_pal::INFO_BUF_SIZE, ptr);
-    tiff_pal::info_buffer_unlock();
+    r.io_lock();
+    r.fread_array(p.color_palette, ptr);
+    r.io_unlock();
     return true;
 }
 bool reader::tag_manager::image_description(const reader &r, const tag_entry &e, page& p)
 {
     if (e.field_count <= 0) return true;
-
-    if (e.field_count <= 4) {
-        uint32_t u32_str = read_scalar<uint32_t>(r, e);
-        std::string temp_str(reinterpret_cast<char*>(&u32_str), 0, e.field_count-1);
-        p.description.swap(temp_str);
-    } else {
-        std::vector<uint8_t> temp_vec(e.field_count, 0);
-        uint32_t ptr = read_scalar<uint32_t>(r, e);
-        tiff_pal::info_buffer_lock();
-        r.fread_array_buffering(temp_vec, tiff_pal::info_buffer, tiff_pal::INFO_BUF_SIZE, ptr);
-        tiff_pal::info_buffer_unlock();
-        std::string temp_str(temp_vec.begin(), temp_vec.end()-1);
-        p.description.swap(temp_str);
-    }
+    if (!fits_in_source(r, e, 1)) return false;
+
+    // Read straight into the arena-backed string, then drop the NUL.
+    p.description.resize(e.field_count);
+    r.io_lock();
+    r.read_tag_bytes(e, p.description.data(), e.field_count);
+    r.io_unlock();
+    p.description.resize(e.field_count - 1);
     return true;
 }
 bool reader::tag_manager::samples_per_pixel(const reader &r, const tag_entry &e, page& p)
@@ -620,15 +1785,20 @@ bool reader::tag_manager::date_time(const reader &r, const tag_entry &e, page& p
 {
     if (e.field_count != 20) return false;
 
-    std::vector<uint8_t> temp_vec(20, 0);
+    p.date_time.resize(20);
     uint32_t ptr = read_scalar<uint32_t>(r, e);
-    tiff_pal::info_buffer_lock();
-    r.fread_array_buffering(temp_vec, tiff_pal::info_buffer, tiff_pal::INFO_BUF_SIZE, ptr);
-    tiff_pal::info_buffer_unlock();
-    std::string temp_str(temp_vec.begin(), temp_vec.end()-1);
-    p.date_time.swap(temp_str);
+    r.io_lock();
+    r.fread_pos(p.date_time.data(), ptr, 20);
+    r.io_unlock();
+    p.date_time.resize(19);
+    return true;
+}
+bool reader::tag_manager::ink_set(const reader &r, const tag_entry &e, page& p)
+{
+    p.ink_set = static_cast<ink_set_t>(read_scalar<uint16_t>(r, e));
     return true;
 }
+
 bool reader::tag_manager::extra_samples(const reader &r, const tag_entry &e, page& p)
 {
     p.extra_sample_counts = e.field_count;
@@ -636,4 +1806,50 @@ bool reader::tag_manager::extra_samples(const reader &r, const tag_entry &e, pag
     return true;
 }
 
+bool reader::tag_manager::ycbcr_coefficients(const reader &r, const tag_entry &e, page& p)
+{
+    if (e.field_type != data_t::RATIONAL || e.field_count != 3) return false;
+
+    uint32_t v[6];
+    r.io_lock();
+    r.fread_pos(v, read_scalar<uint32_t>(r, e), sizeof(v));
+    r.io_unlock();
+    if (r.need_swap) {
+        bswap32_array(v, 6);
+    }
+    for (int i = 0; i < 3; i++) {
+        p.ycbcr_coefficients[i] = {v[2*i], v[2*i + 1]};
+    }
+    return true;
+}
+
+bool reader::tag_manager::ycbcr_sub_sampling(const reader &r, const tag_entry &e, page& p)
+{
+    if (e.field_type != data_t::SHORT || e.field_count != 2) return false;
+
+    uint16_t v[2];
+    r.read_tag_bytes(e, v, sizeof(v));
+    if (r.need_swap) {
+        bswap16_array(v, 2);
+    }
+    // 1, 2 or 4 each way, and never more vertically than horizontally
+    auto valid = [](uint16_t s) { return s == 1 || s == 2 || s == 4; };
+    if (!valid(v[0]) || !valid(v[1]) || v[1] > v[0]) return false;
+    p.ycbcr_sub_sampling[0] = v[0];
+    p.ycbcr_sub_sampling[1] = v[1];
+    return true;
+}
+
+bool reader::tag_manager::jpeg_tables(const reader &r, const tag_entry &e, page& p)
+{
+    if (e.field_count == 0) return true;
+    if (!fits_in_source(r, e, 1)) return false;
+
+    p.jpeg_tables.resize(e.field_count);
+    r.io_lock();
+    r.read_tag_bytes(e, p.jpeg_tables.data(), e.field_count);
+    r.io_unlock();
+    return true;
+}
+
 }
@@ -0,0 +1,401 @@
+#include "tiff_reader.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define TIFF_SIDECAR_MMAP
+#endif
+
+namespace tiff {
+
+// Sidecar index layout. Everything is in host byte order and read in place,
+// so an index only serves the kind of machine that wrote it: the header
+// records the byte order and record size and any mismatch means a re-parse.
+//
+//   index_header, index_page[page_count], arrays (8-byte aligned)
+
+namespace {
+
+constexpr char index_magic[4] = {'T', 'I', 'D', 'X'};
+constexpr uint32_t index_version = 3;
+// index_page::flags
+constexpr uint16_t index_page_invalid = 1;
+constexpr uint32_t index_byte_order = 0x01020304;
+
+struct index_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t page_record_size;
+    uint64_t index_size;
+    // What the index was built from
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint32_t first_ifd;
+    uint32_t page_count;
+    endian_t tiff_order;
+    uint8_t reserved[7];
+};
+
+// Offset in the index and element count of one array
+struct index_array
+{
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct index_page
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t rows_per_strip;
+    uint32_t extra_sample_counts;
+    uint16_t sample_per_pixel;
+    compression_t compression;
+    colorspace_t colorspace;
+    extra_data_t extra_sample_type;
+    planar_configuration_t planar_configuration;
+    uint16_t ycbcr_sub_sampling[2];
+    uint16_t flags;
+    ink_set_t ink_set;
+    uint16_t reserved;
+    rational_t x_resolution;
+    rational_t y_resolution;
+    rational_t ycbcr_coefficients[3];
+    index_array bit_per_samples;
+    index_array color_palette;
+    index_array strip_offsets;
+    index_array strip_byte_counts;
+    index_array jpeg_tables;
+    index_array description;
+    index_array date_time;
+    // Entries of tags without a built-in proc, replayed to custom procs
+    index_array entries;
+};
+
+static_assert(std::is_trivially_copyable<index_header>::value && std::is_trivially_copyable<index_page>::value,
+        "index records are copied as bytes.");
+static_assert(sizeof(index_header) % 8 == 0 && sizeof(index_page) % 8 == 0,
+        "index records must keep the arrays 8-byte aligned.");
+
+bool source_mtime(const std::string& path, int64_t& mtime)
+{
+    std::error_code ec;
+    const auto t = std::filesystem::last_write_time(path, ec);
+    if (ec) return false;
+    mtime = t.time_since_epoch().count();
+    return true;
+}
+
+// The bytes of an index file, mapped where the platform allows it
+class index_file
+{
+private:
+    const uint8_t* bytes = nullptr;
+    size_t length = 0;
+#ifdef TIFF_SIDECAR_MMAP
+    void* map = MAP_FAILED;
+#else
+    std::vector<uint8_t> buf;
+#endif
+
+public:
+    index_file() = default;
+    index_file(const index_file&) = delete;
+    index_file& operator=(const index_file&) = delete;
+
+    ~index_file()
+    {
+#ifdef TIFF_SIDECAR_MMAP
+        if (map != MAP_FAILED) {
+            munmap(map, length);
+        }
+#endif
+    }
+
+    bool open(const std::string& path)
+    {
+#ifdef TIFF_SIDECAR_MMAP
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(index_header))) {
+            length = st.st_size;
+            map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (map == MAP_FAILED) return false;
+        bytes = static_cast<const uint8_t*>(map);
+#else
+        FILE* fp = std::fopen(path.c_str(), "rb");
+        if (!fp) return false;
+        std::fseek(fp, 0, SEEK_END);
+        const long end = std::ftell(fp);
+        if (end > 0) {
+            buf.resize(end);
+            std::fseek(fp, 0, SEEK_SET);
+            buf.resize(std::fread(buf.data(), 1, buf.size(), fp));
+        }
+        std::fclose(fp);
+        bytes = buf.data();
+        length = buf.size();
+#endif
+        return length >= sizeof(index_header);
+    }
+
+    const uint8_t* data() const
+    {
+        return bytes;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    // The elements of a, or nullptr when they are not within the file
+    template<typename T>
+    const T* array(const index_array& a) const
+    {
+        if (a.offset % alignof(T) != 0 || a.offset > length || a.count > (length - a.offset) / sizeof(T)) {
+            return nullptr;
+        }
+        return reinterpret_cast<const T*>(bytes + a.offset);
+    }
+};
+
+class index_writer
+{
+private:
+    std::vector<uint8_t> out;
+
+public:
+    explicit index_writer(const size_t page_count)
+        : out(sizeof(index_header) + page_count * sizeof(index_page))
+    {}
+
+    template<typename T>
+    index_array append(const T* data, const size_t count)
+    {
+        out.resize((out.size() + 7) & ~size_t(7));
+        const index_array a{out.size(), count};
+        const auto p = reinterpret_cast<const uint8_t*>(data);
+        out.insert(out.end(), p, p + count * sizeof(T));
+        return a;
+    }
+
+    template<typename C>
+    index_array append(const C& c)
+    {
+        return append(c.data(), c.size());
+    }
+
+    void set_page(const size_t i, const index_page& p)
+    {
+        std::memcpy(out.data() + sizeof(index_header) + i * sizeof(index_page), &p, sizeof(p));
+    }
+
+    // A temporary file next to path that no other writer of the same index
+    // can pick, so processes indexing one file at once do not collide
+    static FILE* create_temp(const std::string& path, std::string& tmp)
+    {
+#ifdef TIFF_SIDECAR_MMAP
+        tmp = path + ".XXXXXX";
+        const int fd = mkstemp(tmp.data());
+        if (fd < 0) return nullptr;
+        // mkstemp() creates the file private to its owner
+        fchmod(fd, 0644);
+        FILE* fp = fdopen(fd, "wb");
+        if (!fp) {
+            ::close(fd);
+            std::remove(tmp.c_str());
+        }
+        return fp;
+#else
+        for (int attempt = 0; attempt < 16; attempt++) {
+            tmp = path + "." + std::to_string(std::random_device{}()) + ".tmp";
+            if (FILE* fp = std::fopen(tmp.c_str(), "wbx")) return fp;
+        }
+        return nullptr;
+#endif
+    }
+
+    // Writes a temporary file first so no reader maps a partial index
+    bool write(index_header h, const std::string& path)
+    {
+        h.index_size = out.size();
+        std::memcpy(out.data(), &h, sizeof(h));
+
+        std::string tmp;
+        FILE* fp = create_temp(path, tmp);
+        if (!fp) return false;
+        const bool ok = std::fwrite(out.data(), 1, out.size(), fp) == out.size();
+        if (std::fclose(fp) != 0 || !ok) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, path, ec);
+        if (ec) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+}
+
+reader reader::open_indexed(const std::string& path, const std::string& index_path, const open_mode_t mode,
+        std::pmr::memory_resource* upstream)
+{
+    return reader(path, mode, upstream, index_path.empty() ? path + ".tidx" : index_path);
+}
+
+bool reader::save_index(const std::string& index_path) const
+{
+    index_header h = {};
+    std::memcpy(h.magic, index_magic, sizeof(h.magic));
+    h.version = index_version;
+    h.byte_order = index_byte_order;
+    h.page_record_size = sizeof(index_page);
+    h.source_size = source_size;
+    h.first_ifd = this->h.offset;
+    h.page_count = pages.size();
+    h.tiff_order = endi;
+    if (!decoded || memory || !source_mtime(path, h.source_mtime)) return false;
+
+    index_writer w(pages.size());
+    for (size_t i = 0; i < pages.size(); i++) {
+        const page& p = pages[i];
+        if (!p.load_deferred()) return false;
+
+        index_page rec = {};
+        rec.width = p.width;
+        rec.height = p.height;
+        rec.rows_per_strip = p.rows_per_strip;
+        rec.extra_sample_counts = p.extra_sample_counts;
+        rec.sample_per_pixel = p.sample_per_pixel;
+        rec.compression = p.compression;
+        rec.colorspace = p.colorspace;
+        rec.extra_sample_type = p.extra_sample_type;
+        rec.planar_configuration = p.planar_configuration;
+        rec.ycbcr_sub_sampling[0] = p.ycbcr_sub_sampling[0];
+        rec.ycbcr_sub_sampling[1] = p.ycbcr_sub_sampling[1];
+        rec.flags = p.is_valid() ? 0 : index_page_invalid;
+        rec.ink_set = p.ink_set;
+        rec.x_resolution = p.x_resolution;
+        rec.y_resolution = p.y_resolution;
+        std::copy(std::begin(p.ycbcr_coefficients), std::end(p.ycbcr_coefficients), rec.ycbcr_coefficients);
+        rec.bit_per_samples = w.append(p.bit_per_samples);
+        rec.color_palette = w.append(p.color_palette);
+        rec.strip_offsets = w.append(p.strip_offsets);
+        rec.strip_byte_counts = w.append(p.strip_byte_counts);
+        rec.jpeg_tables = w.append(p.jpeg_tables);
+        rec.description = w.append(p.description);
+        rec.date_time = w.append(p.date_time);
+
+        std::vector<tag_entry> others;
+        if (i < ifds.size()) {
+            for (auto& e: ifds[i].entries) {
+                if (!find_tag_proc(e.tag)) {
+                    others.push_back(e);
+                }
+            }
+        }
+        rec.entries = w.append(others);
+        w.set_page(i, rec);
+    }
+    return w.write(h, index_path);
+}
+
+bool reader::load_index()
+{
+    int64_t mtime;
+    if (memory || !source_mtime(path, mtime)) return false;
+    index_file f;
+    if (!f.open(index_path)) return false;
+
+    index_header h;
+    std::memcpy(&h, f.data(), sizeof(h));
+    const bool match = std::memcmp(h.magic, index_magic, sizeof(h.magic)) == 0
+        && h.version == index_version && h.byte_order == index_byte_order
+        && h.page_record_size == sizeof(index_page) && h.index_size == f.size()
+        && h.source_size == source_size && h.source_mtime == mtime
+        && h.first_ifd == this->h.offset && h.tiff_order == endi
+        && h.page_count <= (f.size() - sizeof(h)) / sizeof(index_page);
+    if (!match) return false;
+
+    auto fail = [this]() {
+        std::pmr::vector<page>(arena.get()).swap(pages);
+        std::pmr::vector<ifd>(arena.get()).swap(ifds);
+        return false;
+    };
+    auto copy = [&f](auto& dst, const index_array& a) {
+        using T = typename std::remove_reference_t<decltype(dst)>::value_type;
+        const T* src = f.array<T>(a);
+        if (!src) return false;
+        dst.assign(src, src + a.count);
+        return true;
+    };
+
+    pages.reserve(h.page_count);
+    ifds.reserve(h.page_count);
+    for (uint32_t i = 0; i < h.page_count; i++) {
+        index_page rec;
+        std::memcpy(&rec, f.data() + sizeof(h) + i * sizeof(index_page), sizeof(rec));
+        pages.push_back(page(*this));
+        page& p = pages.back();
+        p.width = rec.width;
+        p.height = rec.height;
+        p.rows_per_strip = rec.rows_per_strip;
+        p.extra_sample_counts = rec.extra_sample_counts;
+        p.sample_per_pixel = rec.sample_per_pixel;
+        p.compression = rec.compression;
+        p.colorspace = rec.colorspace;
+        p.extra_sample_type = rec.extra_sample_type;
+        p.planar_configuration = rec.planar_configuration;
+        p.ink_set = rec.ink_set;
+        p.ycbcr_sub_sampling[0] = rec.ycbcr_sub_sampling[0];
+        p.ycbcr_sub_sampling[1] = rec.ycbcr_sub_sampling[1];
+        p.x_resolution = rec.x_resolution;
+        p.y_resolution = rec.y_resolution;
+        std::copy(std::begin(rec.ycbcr_coefficients), std::end(rec.ycbcr_coefficients), p.ycbcr_coefficients);
+
+        ifds.push_back({0, std::pmr::vector<tag_entry>(get_memory_resource()), 0});
+        auto& entries = ifds.back().entries;
+        if (!copy(p.bit_per_samples, rec.bit_per_samples) || !copy(p.color_palette, rec.color_palette)
+                || !copy(p.strip_offsets, rec.strip_offsets) || !copy(p.strip_byte_counts, rec.strip_byte_counts)
+                || !copy(p.jpeg_tables, rec.jpeg_tables) || !copy(p.description, rec.description)
+                || !copy(p.date_time, rec.date_time) || !copy(entries, rec.entries)) {
+            return fail();
+        }
+        ifds.back().entry_count = entries.size();
+    }
+
+    // Only custom procs are left to run, then every page is validated as
+    // after a parse.
+    if (!read_entry_tags(ifds, pages) || pages.size() != h.page_count) return fail();
+    for (uint32_t i = 0; i < h.page_count; i++) {
+        index_page rec;
+        std::memcpy(&rec, f.data() + sizeof(h) + i * sizeof(index_page), sizeof(rec));
+        if (rec.flags & index_page_invalid) {
+            pages[i].invalidate();
+        }
+    }
+    return true;
+}
+
+}
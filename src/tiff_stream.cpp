@@ -0,0 +1,151 @@
+#include "tiff_reader.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace tiff {
+
+// Input is pulled at least this much at a time
+constexpr size_t stream_chunk = 64 * 1024;
+
+// The bytes pulled from the input that may still be read: spool[head] is
+// at offset base + head of the input. While pinned every byte is kept;
+// otherwise each read drops what lies before it.
+struct reader::stream_state
+{
+    stream_read read;
+    size_t max_spool;
+    std::vector<uint8_t> spool;
+    size_t head = 0;
+    uint64_t base = 0;
+    bool pinned = true;
+    bool ended = false;
+    bool overflow = false;
+    bool reported = false;
+
+    uint64_t begin() const
+    {
+        return base + head;
+    }
+
+    uint64_t end() const
+    {
+        return base + spool.size();
+    }
+
+    // Forgets the bytes before pos, moving the rest down once the dead
+    // front is as large as what is left
+    void release(const uint64_t pos)
+    {
+        if (pos <= begin()) return;
+        head = std::min<uint64_t>(pos - base, spool.size());
+        if (head == spool.size()) {
+            base += head;
+            spool.clear();
+            head = 0;
+        } else if (head >= spool.size() - head) {
+            spool.erase(spool.begin(), spool.begin() + head);
+            base += head;
+            head = 0;
+        }
+    }
+
+    // Reads and drops input up to pos; only called with nothing spooled
+    void skip(const uint64_t pos)
+    {
+        uint8_t buf[4096];
+        while (!ended && base < pos) {
+            const size_t got = read(buf, std::min<uint64_t>(sizeof(buf), pos - base));
+            base += got;
+            ended = got == 0;
+        }
+    }
+
+    // Pulls input until the spool reaches end, within max_spool
+    void fill(const uint64_t want_end)
+    {
+        while (!ended && end() < want_end) {
+            size_t want = std::max<uint64_t>(want_end - end(), stream_chunk);
+            const size_t held = spool.size() - head;
+            if (held + want > max_spool) {
+                if (held + (want_end - end()) > max_spool) {
+                    if (!overflow) {
+                        fprintf(stderr, "Stream needs more than %zu bytes spooled.\n", max_spool);
+                        overflow = true;
+                    }
+                    return;
+                }
+                want = max_spool - held;
+            }
+            const size_t old = spool.size();
+            spool.resize(old + want);
+            const size_t got = read(spool.data() + old, want);
+            spool.resize(old + got);
+            ended = got == 0;
+        }
+    }
+};
+
+void reader::stream_deleter::operator()(stream_state* s) const
+{
+    delete s;
+}
+
+reader::reader(stream_read read, const size_t max_spool, std::pmr::memory_resource* upstream) :
+    mode(open_mode_t::FULL), source(0), stream(new stream_state{std::move(read), max_spool, {}}),
+    source_size(UINT64_MAX),
+    io_mtx(std::make_unique<std::mutex>()), load_mtx(std::make_unique<std::mutex>()),
+    arena(std::make_unique<arena_resource>(
+                arena_initial_size, upstream ? upstream : std::pmr::get_default_resource())),
+    ifds(arena.get()), pages(arena.get())
+{
+    load();
+}
+
+reader reader::open_stream(stream_read read, const size_t max_spool, std::pmr::memory_resource* upstream)
+{
+    return reader(std::move(read), max_spool, upstream);
+}
+
+size_t reader::read_stream(void* dest, const uint64_t pos, const size_t size) const
+{
+    stream_state& s = *stream;
+    if (!s.pinned) {
+        s.release(pos);
+        if (s.head == s.spool.size()) {
+            s.skip(pos);
+        }
+    }
+    if (pos < s.begin()) {
+        if (!s.reported) {
+            fprintf(stderr, "Stream data at %llu was already passed.\n", static_cast<unsigned long long>(pos));
+            s.reported = true;
+        }
+        return 0;
+    }
+    s.fill(pos + size);
+    if (pos >= s.end()) return 0;
+    const size_t got = std::min<uint64_t>(size, s.end() - pos);
+    std::memcpy(dest, s.spool.data() + (pos - s.base), got);
+    return got;
+}
+
+uint64_t reader::read_limit() const
+{
+    return stream ? stream->max_spool : source_size;
+}
+
+bool reader::end_stream_parse()
+{
+    // Tags cut off by the spool limit would read as zeros
+    if (stream->overflow) return false;
+    // Strips in file order are read front to back, so nothing behind a
+    // read is wanted again.
+    const page& p = pages.front();
+    stream->pinned = !std::is_sorted(p.strip_offsets.begin(), p.strip_offsets.end());
+    return true;
+}
+
+}
@@ -0,0 +1,247 @@
+#include "tiff_tensor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace tiff {
+
+// Decoded rows kept in flight when the tensor has the page's size
+constexpr size_t tensor_band_bytes = 64 * 1024;
+
+namespace {
+
+template<typename T>
+T convert(const float v);
+
+template<>
+float convert(const float v)
+{
+    return v;
+}
+
+template<>
+uint8_t convert(const float v)
+{
+    return static_cast<uint8_t>(std::clamp(std::lrint(v), 0l, 255l));
+}
+
+const uint8_t* samples(const color_t& c)
+{
+    return reinterpret_cast<const uint8_t*>(&c);
+}
+
+// Where output channel c of pixel (x, y) goes, in elements
+struct tensor_index
+{
+    size_t row;         // between rows
+    size_t pixel;       // between pixels of a row
+    size_t channel;     // between channels of a pixel
+
+    size_t at(const uint32_t x, const uint32_t y, const unsigned c) const
+    {
+        return y * row + x * pixel + c * channel;
+    }
+};
+
+// Source rows for bilinear resizing; the two most recent stay decoded, so
+// each row is decoded once as the output walks down.
+class row_pair
+{
+private:
+    const page& p;
+    std::vector<color_t> buf[2];
+    int64_t index[2] = {-1, -1};
+
+public:
+    explicit row_pair(const page& p) : p(p)
+    {
+        buf[0].resize(p.width);
+        buf[1].resize(p.width);
+    }
+
+    // Returns row y without evicting row keep
+    const color_t* get(const uint32_t y, const uint32_t keep, bool& ok)
+    {
+        for (int s = 0; s < 2; s++) {
+            if (index[s] == y) return buf[s].data();
+        }
+        const int s = index[0] == keep ? 1 : 0;
+        ok = p.get_region(0, y, p.width, 1, buf[s].data()) == 1 && ok;
+        index[s] = y;
+        return buf[s].data();
+    }
+};
+
+template<typename T>
+bool fill_same_size(const page& p, const tensor_options& opt, const tensor_index& ix, T* out)
+{
+    // Scale and offset collapse into one table lookup per sample
+    T lut[4][256];
+    for (unsigned c = 0; c < opt.channels; c++) {
+        for (unsigned v = 0; v < 256; v++) {
+            lut[c][v] = convert<T>(v * opt.scale[c] + opt.offset[c]);
+        }
+    }
+
+    const uint32_t band = std::clamp<size_t>(tensor_band_bytes / (size_t(p.width) * sizeof(color_t)), 1, p.height);
+    std::vector<color_t> rows(size_t(p.width) * band);
+    bool ok = true;
+    for (uint32_t y = 0; y < p.height; y += band) {
+        const uint32_t n = std::min(band, p.height - y);
+        if (p.get_region(0, y, p.width, n, rows.data()) != static_cast<int>(n)) ok = false;
+        for (uint32_t r = 0; r < n; r++) {
+            const color_t* src = rows.data() + size_t(r) * p.width;
+            for (unsigned c = 0; c < opt.channels; c++) {
+                const T* l = lut[c];
+                const unsigned m = opt.channel_map[c];
+                T* dst = out + ix.at(0, y + r, c);
+                for (uint32_t x = 0; x < p.width; x++, dst += ix.pixel) {
+                    *dst = l[samples(src[x])[m]];
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+// Bilinear sample position of each output coordinate along one axis,
+// with pixel centres aligned as in common image libraries.
+struct axis_map
+{
+    std::vector<uint32_t> i0;
+    std::vector<uint32_t> i1;
+    std::vector<float> w;
+
+    axis_map(const uint32_t src, const uint32_t dst) : i0(dst), i1(dst), w(dst)
+    {
+        const double ratio = static_cast<double>(src) / dst;
+        for (uint32_t d = 0; d < dst; d++) {
+            const double f = std::clamp((d + 0.5) * ratio - 0.5, 0.0, static_cast<double>(src - 1));
+            i0[d] = static_cast<uint32_t>(f);
+            i1[d] = std::min(i0[d] + 1, src - 1);
+            w[d] = static_cast<float>(f - i0[d]);
+        }
+    }
+};
+
+template<typename T>
+bool fill_resized(const page& p, const tensor_options& opt, const tensor_index& ix,
+        const uint32_t out_w, const uint32_t out_h, T* out)
+{
+    // Content box inside the output
+    uint32_t cw = out_w, ch = out_h;
+    if (opt.keep_aspect) {
+        const double s = std::min(static_cast<double>(out_w) / p.width, static_cast<double>(out_h) / p.height);
+        cw = std::clamp<uint32_t>(std::lround(p.width * s), 1, out_w);
+        ch = std::clamp<uint32_t>(std::lround(p.height * s), 1, out_h);
+    }
+    const uint32_t ox = (out_w - cw) / 2;
+    const uint32_t oy = (out_h - ch) / 2;
+
+    // Affine, so it can be applied before interpolating
+    float lut[4][256];
+    for (unsigned c = 0; c < opt.channels; c++) {
+        for (unsigned v = 0; v < 256; v++) {
+            lut[c][v] = v * opt.scale[c] + opt.offset[c];
+        }
+    }
+    const T pad = convert<T>(opt.pad);
+    auto fill_pad = [&](const uint32_t y, const uint32_t x0, const uint32_t x1) {
+        for (unsigned c = 0; c < opt.channels; c++) {
+            T* dst = out + ix.at(x0, y, c);
+            for (uint32_t x = x0; x < x1; x++, dst += ix.pixel) {
+                *dst = pad;
+            }
+        }
+    };
+
+    const axis_map xs(p.width, cw);
+    const axis_map ys(p.height, ch);
+    row_pair rows(p);
+    bool ok = true;
+    for (uint32_t y = 0; y < out_h; y++) {
+        if (y < oy || y >= oy + ch) {
+            fill_pad(y, 0, out_w);
+            continue;
+        }
+        fill_pad(y, 0, ox);
+        fill_pad(y, ox + cw, out_w);
+
+        const uint32_t sy = y - oy;
+        const color_t* top = rows.get(ys.i0[sy], ys.i1[sy], ok);
+        const color_t* bottom = rows.get(ys.i1[sy], ys.i0[sy], ok);
+        const float wy = ys.w[sy];
+        for (unsigned c = 0; c < opt.channels; c++) {
+            const float* l = lut[c];
+            const unsigned m = opt.channel_map[c];
+            T* dst = out + ix.at(ox, y, c);
+            for (uint32_t x = 0; x < cw; x++, dst += ix.pixel) {
+                const uint32_t a = xs.i0[x], b = xs.i1[x];
+                const float wx = xs.w[x];
+                const float t = l[samples(top[a])[m]] + (l[samples(top[b])[m]] - l[samples(top[a])[m]]) * wx;
+                const float u = l[samples(bottom[a])[m]] + (l[samples(bottom[b])[m]] - l[samples(bottom[a])[m]]) * wx;
+                *dst = convert<T>(t + (u - t) * wy);
+            }
+        }
+    }
+    return ok;
+}
+
+template<typename T>
+bool fill(const page& p, const tensor_options& opt, T* out)
+{
+    const uint32_t w = tensor_width(p, opt);
+    const uint32_t h = tensor_height(p, opt);
+    tensor_index ix;
+    if (opt.layout == tensor_layout_t::PLANAR) {
+        ix = {w, 1, size_t(w) * h};
+    } else {
+        ix = {size_t(w) * opt.channels, opt.channels, 1};
+    }
+    if (w == p.width && h == p.height) {
+        return fill_same_size(p, opt, ix, out);
+    }
+    return fill_resized(p, opt, ix, w, h, out);
+}
+
+}
+
+void tensor_options::normalize(const float* mean, const float* stddev)
+{
+    for (unsigned c = 0; c < channels && c < 4; c++) {
+        scale[c] = 1.0f / (255.0f * stddev[c]);
+        offset[c] = -mean[c] / stddev[c];
+    }
+}
+
+uint32_t tensor_width(const page& p, const tensor_options& opt)
+{
+    return opt.width ? opt.width : p.width;
+}
+
+uint32_t tensor_height(const page& p, const tensor_options& opt)
+{
+    return opt.height ? opt.height : p.height;
+}
+
+size_t tensor_bytes(const page& p, const tensor_options& opt)
+{
+    const size_t elem = opt.type == tensor_type_t::FLOAT32 ? sizeof(float) : sizeof(uint8_t);
+    return size_t(tensor_width(p, opt)) * tensor_height(p, opt) * opt.channels * elem;
+}
+
+bool decode_tensor(const page& p, const tensor_options& opt, void* out)
+{
+    if (opt.channels == 0 || opt.channels > 4 || p.width == 0 || p.height == 0) return false;
+    for (unsigned c = 0; c < opt.channels; c++) {
+        if (opt.channel_map[c] > 3) return false;
+    }
+
+    if (opt.type == tensor_type_t::FLOAT32) {
+        return fill(p, opt, static_cast<float*>(out));
+    }
+    return fill(p, opt, static_cast<uint8_t*>(out));
+}
+
+}